@@ -1,5 +1,13 @@
 #include "mpc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define MPC_USE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 /*
 ** State Type
 */
@@ -29,9 +37,12 @@ static mpc_state_t mpc_state_new(void) {
 ** operation: String, File and Pipe.
 **
 ** String is easy. The whole contents are 
-** loaded into a buffer and scanned through.
-** The cursor can jump around at will making 
-** backtracking easy.
+** in memory and scanned through in place -
+** the caller's buffer is borrowed for the
+** length of the parse rather than copied,
+** and `mpc_parse_contents` maps files into
+** memory where it can. The cursor can jump
+** around at will making backtracking easy.
 **
 ** The second is a File which is also somewhat
 ** easy. The contents are never loaded into 
@@ -49,6 +60,15 @@ static mpc_state_t mpc_state_new(void) {
 ** back we can simply start reading from the
 ** buffer instead of the input.
 **
+** The buffer is a ring which only keeps the
+** input from the oldest mark still held (or
+** the cursor, when there are none) onwards,
+** so memory stays bounded by how far back a
+** parse can rewind rather than by the size
+** of the input. Parsing a long stream one
+** item at a time with `mpc_parse_input` on
+** the same input keeps that small.
+**
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
@@ -65,26 +85,81 @@ enum {
   MPC_INPUT_MARKS_MIN = 32
 };
 
+enum {
+  MPC_INPUT_MEMO_MIN = 64
+};
+
+enum {
+  MPC_INPUT_FAILS_MIN = 32
+};
+
+enum {
+  MPC_INPUT_FRAMES_MIN = 64
+};
+
 enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
+enum {
+  MPC_INPUT_BUFFER_MIN = 64
+};
+
 typedef struct {
   char mem[64];
 } mpc_mem_t;
 
 typedef struct {
+  mpc_state_t state;
+  mpc_parser_t *p;
+  int s;
+  char recieved;
+} mpc_fail_t;
+
+typedef struct mpc_memo_t {
+  mpc_parser_t *p;
+  long pos;
+  int success;
+  int kept;
+  mpc_state_t state;
+  char last;
+  mpc_val_t *output;
+  mpc_dtor_t dx;
+  int error;
+  int fails_num;
+  mpc_fail_t *fails;
+  struct mpc_memo_t *next;
+} mpc_memo_t;
+
+typedef struct {
+  mpc_parser_t *p;
+  int j;
+  int k;
+  int n;
+  long pos;
+  long far;
+  mpc_memo_t *m;
+} mpc_frame_t;
+
+struct mpc_input_t {
 
   int type;
   char *filename;  
   mpc_state_t state;
   
-  char *string;
+  const char *string;
+  size_t length;
+  int mapped;
   char *buffer;
+  size_t buffer_head;
+  size_t buffer_len;
+  size_t buffer_max;
+  long buffer_pos;
   FILE *file;
   
   int suppress;
   int backtrack;
+  int spanning;
   int marks_slots;
   int marks_num;
   mpc_state_t *marks;
@@ -92,13 +167,55 @@ typedef struct {
   char *lasts;
   char last;
   
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
+  mpc_memo_t **memo;
+  size_t memo_slots;
+  size_t memo_num;
+  size_t memo_sweep;
+  
+  int fails_slots;
+  int fails_num;
+  mpc_fail_t *fails;
+  int exceeded;
+  
+  int frames_slots;
+  int frames_num;
+  int frames_max;
+  mpc_frame_t *frames;
+  int vals_slots;
+  int vals_num;
+  mpc_val_t **vals;
+  
+  size_t mem_used;
+  unsigned short mem_free[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
   
-} mpc_input_t;
+};
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+/*
+** Free slots in the memory pool are kept on a
+** stack, so taking or releasing one is a
+** single step however full the pool is.
+*/
+
+static void mpc_input_mem_init(mpc_input_t *i) {
+  size_t j;
+  i->mem_used = 0;
+  for (j = 0; j < MPC_INPUT_MEM_NUM; j++) {
+    i->mem_free[j] = (unsigned short)(MPC_INPUT_MEM_NUM - 1 - j);
+  }
+}
+
+/*
+** The length of a string input is taken once
+** up front, and the pipe buffer keeps its own
+** length, so that neither has to be measured
+** again for every character consumed. As the
+** length is known the string need not end in
+** a NUL, which lets a mapped file be used as
+** it is.
+*/
+
+mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
@@ -108,26 +225,83 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = string;
+  i->length = length;
+  i->mapped = 0;
   i->buffer = NULL;
+  i->buffer_head = 0;
+  i->buffer_len = 0;
+  i->buffer_max = 0;
+  i->buffer_pos = 0;
   i->file = NULL;
   
   i->suppress = 0;
   i->backtrack = 1;
+  i->spanning = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_sweep = MPC_INPUT_MEMO_MIN;
+  
+  i->fails_slots = MPC_INPUT_FAILS_MIN;
+  i->fails_num = 0;
+  i->fails = malloc(sizeof(mpc_fail_t) * i->fails_slots);
+  i->exceeded = 0;
+  
+  i->frames_slots = MPC_INPUT_FRAMES_MIN;
+  i->frames_num = 0;
+  i->frames_max = 0;
+  i->frames = malloc(sizeof(mpc_frame_t) * i->frames_slots);
+  i->vals_slots = MPC_INPUT_FRAMES_MIN;
+  i->vals_num = 0;
+  i->vals = malloc(sizeof(mpc_val_t*) * i->vals_slots);
+  
+  mpc_input_mem_init(i);
+  
+  return i;
+}
+
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+  return mpc_input_new_nstring(filename, string, strlen(string));
+}
+
+/*
+** Maps the open file `fd` into memory and
+** returns a string input over it, or NULL
+** if it cannot be mapped (if it is a pipe
+** or terminal say).
+*/
+
+static mpc_input_t *mpc_input_new_mapped(const char *filename, int fd) {
+#ifdef MPC_USE_MMAP
+  
+  struct stat st;
+  void *m;
+  mpc_input_t *i;
+  
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { return NULL; }
+  if (st.st_size == 0) { return mpc_input_new_nstring(filename, "", 0); }
+  
+  m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (m == MAP_FAILED) { return NULL; }
   
+  i = mpc_input_new_nstring(filename, m, (size_t)st.st_size);
+  i->mapped = 1;
   return i;
+  
+#else
+  (void)filename; (void)fd;
+  return NULL;
+#endif
 }
 
-static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
+mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
@@ -138,19 +312,43 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
-  i->buffer = NULL;
+  i->length = 0;
+  i->mapped = 0;
+  i->buffer = malloc(MPC_INPUT_BUFFER_MIN);
+  i->buffer_head = 0;
+  i->buffer_len = 0;
+  i->buffer_max = MPC_INPUT_BUFFER_MIN;
+  i->buffer_pos = 0;
   i->file = pipe;
   
   i->suppress = 0;
   i->backtrack = 1;
+  i->spanning = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_sweep = MPC_INPUT_MEMO_MIN;
+  
+  i->fails_slots = MPC_INPUT_FAILS_MIN;
+  i->fails_num = 0;
+  i->fails = malloc(sizeof(mpc_fail_t) * i->fails_slots);
+  i->exceeded = 0;
+  
+  i->frames_slots = MPC_INPUT_FRAMES_MIN;
+  i->frames_num = 0;
+  i->frames_max = 0;
+  i->frames = malloc(sizeof(mpc_frame_t) * i->frames_slots);
+  i->vals_slots = MPC_INPUT_FRAMES_MIN;
+  i->vals_num = 0;
+  i->vals = malloc(sizeof(mpc_val_t*) * i->vals_slots);
+  
+  mpc_input_mem_init(i);
   
   return i;
   
@@ -166,30 +364,150 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
+  i->mapped = 0;
   i->buffer = NULL;
+  i->buffer_head = 0;
+  i->buffer_len = 0;
+  i->buffer_max = 0;
+  i->buffer_pos = 0;
   i->file = file;
   
   i->suppress = 0;
   i->backtrack = 1;
+  i->spanning = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_sweep = MPC_INPUT_MEMO_MIN;
+  
+  i->fails_slots = MPC_INPUT_FAILS_MIN;
+  i->fails_num = 0;
+  i->fails = malloc(sizeof(mpc_fail_t) * i->fails_slots);
+  i->exceeded = 0;
+  
+  i->frames_slots = MPC_INPUT_FRAMES_MIN;
+  i->frames_num = 0;
+  i->frames_max = 0;
+  i->frames = malloc(sizeof(mpc_frame_t) * i->frames_slots);
+  i->vals_slots = MPC_INPUT_FRAMES_MIN;
+  i->vals_num = 0;
+  i->vals = malloc(sizeof(mpc_val_t*) * i->vals_slots);
+  
+  mpc_input_mem_init(i);
   
   return i;
 }
 
-static void mpc_input_delete(mpc_input_t *i) {
+/*
+** The packrat memo maps a parser (or the key
+** it was given) and the position it started
+** at to what it made there. Entries before
+** the oldest mark (or the cursor, when there
+** are none) can never be asked for again, so
+** once the table has doubled since it was
+** last swept those are dropped and it is
+** resized to what is left.
+*/
+
+static size_t mpc_input_memo_hash(mpc_parser_t *p, long pos, size_t slots) {
+  size_t h = ((size_t)p >> 4) * 31 + (size_t)pos;
+  return (h ^ (h >> 16)) & (slots - 1);
+}
+
+static void mpc_input_memo_free(mpc_memo_t *m) {
+  if (m->kept && m->dx) { m->dx(m->output); }
+  free(m->fails);
+  free(m);
+}
+
+static mpc_memo_t *mpc_input_memo_get(mpc_input_t *i, mpc_parser_t *p) {
+  mpc_memo_t *m;
+  if (i->memo_num == 0) { return NULL; }
+  m = i->memo[mpc_input_memo_hash(p, i->state.pos, i->memo_slots)];
+  while (m && (m->p != p || m->pos != i->state.pos)) { m = m->next; }
+  return m;
+}
+
+static void mpc_input_memo_sweep(mpc_input_t *i) {
+  
+  size_t j, h, slots;
+  mpc_memo_t *m, *n, *live = NULL;
+  long floor = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+  
+  i->memo_num = 0;
+  for (j = 0; j < i->memo_slots; j++) {
+    for (m = i->memo[j]; m; m = n) {
+      n = m->next;
+      if (m->pos < floor) { mpc_input_memo_free(m); continue; }
+      m->next = live;
+      live = m;
+      i->memo_num++;
+    }
+  }
+  
+  slots = MPC_INPUT_MEMO_MIN;
+  while (slots < i->memo_num * 2) { slots *= 2; }
+  
+  if (slots != i->memo_slots) {
+    free(i->memo);
+    i->memo = malloc(sizeof(mpc_memo_t*) * slots);
+    i->memo_slots = slots;
+  }
+  memset(i->memo, 0, sizeof(mpc_memo_t*) * slots);
+  
+  for (m = live; m; m = n) {
+    n = m->next;
+    h = mpc_input_memo_hash(m->p, m->pos, slots);
+    m->next = i->memo[h];
+    i->memo[h] = m;
+  }
+  
+  i->memo_sweep = i->memo_num * 2 > MPC_INPUT_MEMO_MIN ?
+    i->memo_num * 2 : MPC_INPUT_MEMO_MIN;
+}
+
+static void mpc_input_memo_put(mpc_input_t *i, mpc_memo_t *m) {
+  size_t h;
+  if (i->memo_slots == 0 || i->memo_num >= i->memo_sweep) { mpc_input_memo_sweep(i); }
+  h = mpc_input_memo_hash(m->p, m->pos, i->memo_slots);
+  m->next = i->memo[h];
+  i->memo[h] = m;
+  i->memo_num++;
+}
+
+static void mpc_input_memo_clear(mpc_input_t *i) {
+  size_t j;
+  mpc_memo_t *m, *n;
+  for (j = 0; j < i->memo_slots; j++) {
+    for (m = i->memo[j]; m; m = n) { n = m->next; mpc_input_memo_free(m); }
+  }
+  free(i->memo);
+  i->memo = NULL;
+  i->memo_slots = 0;
+  i->memo_num = 0;
+  i->memo_sweep = MPC_INPUT_MEMO_MIN;
+}
+
+void mpc_input_delete(mpc_input_t *i) {
   
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
+#ifdef MPC_USE_MMAP
+  if (i->mapped) { munmap((void*)i->string, i->length); }
+#endif
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
+  mpc_input_memo_clear(i);
+  free(i->fails);
+  free(i->frames);
+  free(i->vals);
   free(i->marks);
   free(i->lasts);
   free(i);
@@ -203,22 +521,10 @@ static int mpc_mem_ptr(mpc_input_t *i, void *p) {
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
   size_t j;
-  char *p;
-  
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
-  
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
-  
-  return malloc(n);
+  if (n > sizeof(mpc_mem_t) || i->mem_used == MPC_INPUT_MEM_NUM) { return malloc(n); }
+  j = i->mem_free[MPC_INPUT_MEM_NUM - 1 - i->mem_used];
+  i->mem_used++;
+  return (void*)(i->mem + j);
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -231,7 +537,8 @@ static void mpc_free(mpc_input_t *i, void *p) {
   size_t j;
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
   j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  i->mem_used--;
+  i->mem_free[MPC_INPUT_MEM_NUM - 1 - i->mem_used] = (unsigned short)j;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
@@ -265,6 +572,49 @@ static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 static void mpc_input_suppress_disable(mpc_input_t *i) { i->suppress--; }
 static void mpc_input_suppress_enable(mpc_input_t *i) { i->suppress++; }
 
+/*
+** The pipe buffer holds the `buffer_len` bytes
+** of input from `buffer_pos` onwards, starting
+** at `buffer_head` in a ring of `buffer_max`
+** bytes, which is always a power of two.
+*/
+
+static void mpc_input_buffer_push(mpc_input_t *i, char c) {
+  
+  char *b;
+  size_t first;
+  
+  if (i->buffer_len == i->buffer_max) {
+    b = malloc(i->buffer_max * 2);
+    first = i->buffer_max - i->buffer_head;
+    memcpy(b, i->buffer + i->buffer_head, first);
+    memcpy(b + first, i->buffer, i->buffer_head);
+    free(i->buffer);
+    i->buffer = b;
+    i->buffer_head = 0;
+    i->buffer_max *= 2;
+  }
+  
+  i->buffer[(i->buffer_head + i->buffer_len) & (i->buffer_max - 1)] = c;
+  i->buffer_len++;
+}
+
+static void mpc_input_buffer_discard(mpc_input_t *i) {
+  
+  size_t n = (size_t)(i->state.pos - i->buffer_pos);
+  
+  if (n >= i->buffer_len) {
+    i->buffer_head = 0;
+    i->buffer_len = 0;
+    i->buffer_pos = i->state.pos;
+    return;
+  }
+  
+  i->buffer_head = (i->buffer_head + n) & (i->buffer_max - 1);
+  i->buffer_len -= n;
+  i->buffer_pos = i->state.pos;
+}
+
 static void mpc_input_mark(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
@@ -280,10 +630,6 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-  
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
@@ -302,8 +648,7 @@ static void mpc_input_unmark(mpc_input_t *i) {
   }
   
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
+    mpc_input_buffer_discard(i);
   }
   
 }
@@ -323,17 +668,19 @@ static void mpc_input_rewind(mpc_input_t *i) {
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < i->buffer_pos + (long)i->buffer_len;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  size_t j = i->buffer_head + (size_t)(i->state.pos - i->buffer_pos);
+  return i->buffer[j & (i->buffer_max - 1)];
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
+  if (i->type == MPC_INPUT_PIPE
+  &&  !mpc_input_buffer_in_range(i) && feof(i->file)) { return 1; }
   return 0;
 }
 
@@ -343,13 +690,12 @@ static char mpc_input_getc(mpc_input_t *i) {
   
   switch (i->type) {
     
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+      return i->state.pos < (long)i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
     
-      if (!i->buffer) { c = getc(i->file); return c; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         c = mpc_input_buffer_get(i);
         return c;
       } else {
@@ -366,7 +712,8 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
   
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+      return i->state.pos < (long)i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: 
       
       c = fgetc(i->file);
@@ -377,14 +724,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
     
     case MPC_INPUT_PIPE:
       
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         return mpc_input_buffer_get(i);
       } else {
         c = getc(i->file);
@@ -405,9 +745,7 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
     case MPC_INPUT_PIPE: {
       
-      if (!i->buffer) { ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         break;
       } else {
         ungetc(c, i->file); 
@@ -421,22 +759,26 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
   if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+  &&  i->marks_num > 0 && !mpc_input_buffer_in_range(i)) {
+    mpc_input_buffer_push(i, c);
   }
   
   i->last = c;
   i->state.pos++;
   i->state.col++;
   
+  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
+    mpc_input_buffer_discard(i);
+  }
+  
   if (c == '\n') {
     i->state.col = 0;
     i->state.row++;
   }
   
-  if (o) {
+  if (o && i->spanning) {
+    (*o) = NULL;
+  } else if (o) {
     (*o) = mpc_malloc(i, 2);
     (*o)[0] = c;
     (*o)[1] = '\0';
@@ -445,6 +787,32 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   return 1;
 }
 
+/*
+** Character Sets
+**
+** Sets of characters, such as those a `oneof`
+** matches, are bitmaps of all 256 of them.
+*/
+
+static void mpc_dfa_set_add(unsigned char *s, int c) {
+  s[c >> 3] |= (unsigned char)(1 << (c & 7));
+}
+
+static int mpc_dfa_set_has(const unsigned char *s, int c) {
+  return s[c >> 3] & (1 << (c & 7));
+}
+
+static int mpc_dfa_set_meets(const unsigned char *s, const unsigned char *t) {
+  int j;
+  for (j = 0; j < 32; j++) { if (s[j] & t[j]) { return 1; } }
+  return 0;
+}
+
+static void mpc_dfa_set_union(unsigned char *s, const unsigned char *t) {
+  int j;
+  for (j = 0; j < 32; j++) { s[j] |= t[j]; }
+}
+
 static int mpc_input_any(mpc_input_t *i, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { return 0; }
@@ -463,16 +831,16 @@ static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
   return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_oneof(mpc_input_t *i, const unsigned char *s, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+  return mpc_dfa_set_has(s, (unsigned char)x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_noneof(mpc_input_t *i, const unsigned char *s, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+  return !mpc_dfa_set_has(s, (unsigned char)x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -495,6 +863,8 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
   
+  if (i->spanning) { *o = NULL; return 1; }
+  
   *o = mpc_malloc(i, strlen(c) + 1);
   strcpy(*o, c);
   return 1;
@@ -506,11 +876,72 @@ static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char), char **o) {
 }
 
 static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
-  mpc_state_t *r = mpc_malloc(i, sizeof(mpc_state_t));
+  mpc_state_t *r;
+  if (i->spanning) { return NULL; }
+  r = mpc_malloc(i, sizeof(mpc_state_t));
   memcpy(r, &i->state, sizeof(mpc_state_t));
   return r;
 }
 
+/*
+** Spans
+**
+** While a span is being matched no results
+** are built at all - the primitives return
+** nothing and nothing is folded or applied -
+** and the input from the start of the span to
+** the cursor is copied out once at the end.
+** The start is kept marked, so for pipes it
+** is still in the buffer, even when parsing
+** predictively (however deeply that nests).
+*/
+
+static void mpc_input_span_begin(mpc_input_t *i) {
+  int backtrack = i->backtrack;
+  i->backtrack = 1;
+  mpc_input_mark(i);
+  i->backtrack = backtrack;
+  i->spanning++;
+}
+
+static char *mpc_input_span_end(mpc_input_t *i, int success) {
+  
+  long start = i->marks[i->marks_num-1].pos;
+  size_t n = (size_t)(i->state.pos - start);
+  size_t j, k;
+  int backtrack;
+  char *s = NULL;
+  
+  i->spanning--;
+  
+  if (success && !i->spanning) {
+    s = mpc_malloc(i, n + 1);
+    switch (i->type) {
+      case MPC_INPUT_STRING:
+        memcpy(s, i->string + start, n);
+        break;
+      case MPC_INPUT_FILE:
+        fseek(i->file, start, SEEK_SET);
+        n = fread(s, 1, n, i->file);
+        fseek(i->file, i->state.pos, SEEK_SET);
+        break;
+      case MPC_INPUT_PIPE:
+        k = i->buffer_head + (size_t)(start - i->buffer_pos);
+        for (j = 0; j < n; j++) {
+          s[j] = i->buffer[(k + j) & (i->buffer_max - 1)];
+        }
+        break;
+    }
+    s[n] = '\0';
+  }
+  
+  backtrack = i->backtrack;
+  i->backtrack = 1;
+  mpc_input_unmark(i);
+  i->backtrack = backtrack;
+  return s;
+}
+
 /*
 ** Error Type
 */
@@ -544,14 +975,16 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+/*
+** Writes into a caller supplied buffer of at least four characters so that
+** errors can be built on several threads at once.
+*/
+static const char *mpc_err_char_unescape(char c, char *buffer) {
   
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
-  char_unescape_buffer[3] = '\0';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
   
   switch (c) {
     case '\a': return "bell";
@@ -564,8 +997,8 @@ static const char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
   
 }
@@ -575,6 +1008,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int i;  
   int pos = 0; 
   int max = 1023;
+  char char_buffer[4];
   char *buffer = calloc(1, 1024);
   
   if (x->failure) {
@@ -600,43 +1034,12 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved, char_buffer));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
 }
 
-static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
-  mpc_err_t *x;
-  if (i->suppress) { return NULL; }
-  x = mpc_malloc(i, sizeof(mpc_err_t));
-  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
-  strcpy(x->filename, i->filename);
-  x->state = i->state;
-  x->expected_num = 1;
-  x->expected = mpc_malloc(i, sizeof(char*));
-  x->expected[0] = mpc_malloc(i, strlen(expected) + 1);
-  strcpy(x->expected[0], expected);
-  x->failure = NULL;
-  x->recieved = mpc_input_peekc(i);
-  return x;
-}
-
-static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
-  mpc_err_t *x;
-  if (i->suppress) { return NULL; }
-  x = mpc_malloc(i, sizeof(mpc_err_t));
-  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
-  strcpy(x->filename, i->filename);
-  x->state = i->state;
-  x->expected_num = 0;
-  x->expected = NULL;
-  x->failure = mpc_malloc(i, strlen(failure) + 1);
-  strcpy(x->failure, failure);
-  x->recieved = ' ';
-  return x;
-}
-
 static mpc_err_t *mpc_err_file(const char *filename, const char *failure) {
   mpc_err_t *x;
   x = malloc(sizeof(mpc_err_t));
@@ -651,208 +1054,104 @@ static mpc_err_t *mpc_err_file(const char *filename, const char *failure) {
   return x;
 }
 
-static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
-  int j;
-  if (x == NULL) { return; }
-  for (j = 0; j < x->expected_num; j++) { mpc_free(i, x->expected[j]); }
-  mpc_free(i, x->expected);
-  mpc_free(i, x->filename);
-  mpc_free(i, x->failure);
-  mpc_free(i, x);
-}
-
-static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
-  int j;
-  for (j = 0; j < x->expected_num; j++) {
-    x->expected[j] = mpc_export(i, x->expected[j]);
-  }
-  x->expected = mpc_export(i, x->expected);
-  x->filename = mpc_export(i, x->filename);
-  x->failure = mpc_export(i, x->failure);
-  return mpc_export(i, x);
-}
-
-static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
-  int j;
-  (void)i;
-  for (j = 0; j < x->expected_num; j++) {
-    if (strcmp(x->expected[j], expected) == 0) { return 1; }
-  }
-  return 0;
-}
-
-static void mpc_err_add_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
-  (void)i;
-  x->expected_num++;
-  x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-  x->expected[x->expected_num-1] = mpc_malloc(i, strlen(expected) + 1);
-  strcpy(x->expected[x->expected_num-1], expected);
-}
+/*
+** Parser Type
+*/
 
-static mpc_err_t *mpc_err_or(mpc_input_t *i, mpc_err_t** x, int n) {
-  
-  int j, k, fst;
-  mpc_err_t *e;
-  
-  fst = -1;
-  for (j = 0; j < n; j++) {
-    if (x[j] != NULL) { fst = j; }
-  }
-  
-  if (fst == -1) { return NULL; }
-  
-  e = mpc_malloc(i, sizeof(mpc_err_t));
-  e->state = mpc_state_invalid();
-  e->expected_num = 0;
-  e->expected = NULL;
-  e->failure = NULL;
-  e->filename = mpc_malloc(i, strlen(x[fst]->filename)+1);
-  strcpy(e->filename, x[fst]->filename);
+enum {
+  MPC_TYPE_UNDEFINED = 0,
+  MPC_TYPE_PASS      = 1,
+  MPC_TYPE_FAIL      = 2,
+  MPC_TYPE_LIFT      = 3,
+  MPC_TYPE_LIFT_VAL  = 4,
+  MPC_TYPE_EXPECT    = 5,
+  MPC_TYPE_ANCHOR    = 6,
+  MPC_TYPE_STATE     = 7,
   
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos > e->state.pos) { e->state = x[j]->state; }
-  }
+  MPC_TYPE_ANY       = 8,
+  MPC_TYPE_SINGLE    = 9,
+  MPC_TYPE_ONEOF     = 10,
+  MPC_TYPE_NONEOF    = 11,
+  MPC_TYPE_RANGE     = 12,
+  MPC_TYPE_SATISFY   = 13,
+  MPC_TYPE_STRING    = 14,
   
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos < e->state.pos) { continue; }
-    
-    if (x[j]->failure) {
-      e->failure = mpc_malloc(i, strlen(x[j]->failure)+1);
-      strcpy(e->failure, x[j]->failure);
-      break;
-    }
-    
-    e->recieved = x[j]->recieved;
-    
-    for (k = 0; k < x[j]->expected_num; k++) {
-      if (!mpc_err_contains_expected(i, e, x[j]->expected[k])) {
-        mpc_err_add_expected(i, e, x[j]->expected[k]);
-      }
-    }
-  }
+  MPC_TYPE_APPLY     = 15,
+  MPC_TYPE_APPLY_TO  = 16,
+  MPC_TYPE_PREDICT   = 17,
+  MPC_TYPE_NOT       = 18,
+  MPC_TYPE_MAYBE     = 19,
+  MPC_TYPE_MANY      = 20,
+  MPC_TYPE_MANY1     = 21,
+  MPC_TYPE_COUNT     = 22,
   
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    mpc_err_delete_internal(i, x[j]);
-  }
+  MPC_TYPE_OR        = 23,
+  MPC_TYPE_AND       = 24,
   
-  return e;
-}
+  MPC_TYPE_SPAN      = 25,
+  MPC_TYPE_DFA       = 26,
+  MPC_TYPE_PACKRAT   = 27
+};
 
-static mpc_err_t *mpc_err_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefix) {
+/*
+** DFAs
+**
+** Regular expressions which never need to
+** backtrack are compiled by `mpc_re` into a
+** minimal DFA - a table of 256 transitions
+** for each state, where -1 is the dead state.
+** Dying in state `s` it reports it expected
+** `expected[at[s]]` up to but not including
+** `expected[at[s+1]]`, as the combinators it
+** was compiled from would have, and fails with
+** the last of them if `returns[s]` is set.
+*/
 
-  int j = 0;
-  size_t l = 0;
-  char *expect = NULL;
-  
-  if (x == NULL) { return NULL; }
-  
-  if (x->expected_num == 0) {
-    expect = mpc_calloc(i, 1, 1);
-    x->expected_num = 1;
-    x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-    x->expected[0] = expect;
-    return x;
-  }
-  
-  else if (x->expected_num == 1) {
-    expect = mpc_malloc(i, strlen(prefix) + strlen(x->expected[0]) + 1);
-    strcpy(expect, prefix);
-    strcat(expect, x->expected[0]);
-    mpc_free(i, x->expected[0]);
-    x->expected[0] = expect;
-    return x;
-  }
-  
-  else if (x->expected_num > 1) {
-    
-    l += strlen(prefix);
-    for (j = 0; j < x->expected_num-2; j++) {
-      l += strlen(x->expected[j]) + strlen(", ");
-    }
-    l += strlen(x->expected[x->expected_num-2]);
-    l += strlen(" or ");
-    l += strlen(x->expected[x->expected_num-1]);
-    
-    expect = mpc_malloc(i, l + 1);
-    
-    strcpy(expect, prefix);
-    for (j = 0; j < x->expected_num-2; j++) {
-      strcat(expect, x->expected[j]); strcat(expect, ", ");
-    }
-    strcat(expect, x->expected[x->expected_num-2]);
-    strcat(expect, " or ");
-    strcat(expect, x->expected[x->expected_num-1]);
-
-    for (j = 0; j < x->expected_num; j++) { mpc_free(i, x->expected[j]); }
-    
-    x->expected_num = 1;
-    x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-    x->expected[0] = expect;
-    return x;
-  }
-  
-  return NULL;
-}
-
-static mpc_err_t *mpc_err_many1(mpc_input_t *i, mpc_err_t *x) {
-  return mpc_err_repeat(i, x, "one or more of ");
-}
-
-static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
-  mpc_err_t *y;
-  int digits = n/10 + 1;
-  char *prefix;
-  prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
-  sprintf(prefix, "%i of ", n);
-  y = mpc_err_repeat(i, x, prefix);
-  mpc_free(i, prefix);
-  return y;
-}
-
-static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
-  mpc_err_t *errs[2];
-  errs[0] = x;
-  errs[1] = y;
-  return mpc_err_or(i, errs, 2);
+typedef struct mpc_dfa_t {
+  int num;
+  int start;
+  int *trans;
+  char *accept;
+  int *at;
+  char **expected;
+  char *returns;
+} mpc_dfa_t;
+
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  int j;
+  for (j = 0; j < d->at[d->num]; j++) { free(d->expected[j]); }
+  free(d->expected);
+  free(d->at);
+  free(d->returns);
+  free(d->trans);
+  free(d->accept);
+  free(d);
 }
 
 /*
-** Parser Type
+** The alternatives of an `or` worth trying when
+** the next character is `c` (or 256 at the end
+** of input) are `alts[start[c]]` up to but not
+** including `alts[start[c+1]]`, in order. Each
+** other alternative `j` fails there raising
+** `fails[at[j]]` up to `fails[at[j+1]]`.
 */
 
-enum {
-  MPC_TYPE_UNDEFINED = 0,
-  MPC_TYPE_PASS      = 1,
-  MPC_TYPE_FAIL      = 2,
-  MPC_TYPE_LIFT      = 3,
-  MPC_TYPE_LIFT_VAL  = 4,
-  MPC_TYPE_EXPECT    = 5,
-  MPC_TYPE_ANCHOR    = 6,
-  MPC_TYPE_STATE     = 7,
-  
-  MPC_TYPE_ANY       = 8,
-  MPC_TYPE_SINGLE    = 9,
-  MPC_TYPE_ONEOF     = 10,
-  MPC_TYPE_NONEOF    = 11,
-  MPC_TYPE_RANGE     = 12,
-  MPC_TYPE_SATISFY   = 13,
-  MPC_TYPE_STRING    = 14,
-  
-  MPC_TYPE_APPLY     = 15,
-  MPC_TYPE_APPLY_TO  = 16,
-  MPC_TYPE_PREDICT   = 17,
-  MPC_TYPE_NOT       = 18,
-  MPC_TYPE_MAYBE     = 19,
-  MPC_TYPE_MANY      = 20,
-  MPC_TYPE_MANY1     = 21,
-  MPC_TYPE_COUNT     = 22,
-  
-  MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
-};
+typedef struct mpc_dispatch_t {
+  int n;
+  int start[258];
+  int *alts;
+  int *at;
+  mpc_fail_t *fails;
+} mpc_dispatch_t;
+
+static void mpc_dispatch_delete(mpc_dispatch_t *d) {
+  if (d == NULL) { return; }
+  free(d->fails);
+  free(d->at);
+  free(d->alts);
+  free(d);
+}
 
 typedef struct { char *m; } mpc_pdata_fail_t;
 typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
@@ -862,12 +1161,16 @@ typedef struct { char x; } mpc_pdata_single_t;
 typedef struct { char x; char y; } mpc_pdata_range_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
 typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { char *x; unsigned char s[32]; } mpc_pdata_oneof_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
-typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
+typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; mpc_apply_t g; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
+typedef struct { mpc_parser_t *x; } mpc_pdata_span_t;
+typedef struct { mpc_parser_t *x; mpc_dfa_t *d; } mpc_pdata_dfa_t;
+typedef struct { mpc_parser_t *x; mpc_apply_t copy; mpc_dtor_t dx; mpc_parser_t *key; } mpc_pdata_packrat_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; mpc_dispatch_t *d; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
 
 typedef union {
@@ -879,9 +1182,13 @@ typedef union {
   mpc_pdata_range_t range;
   mpc_pdata_satisfy_t satisfy;
   mpc_pdata_string_t string;
+  mpc_pdata_oneof_t oneof;
   mpc_pdata_apply_t apply;
   mpc_pdata_apply_to_t apply_to;
   mpc_pdata_predict_t predict;
+  mpc_pdata_span_t span;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_packrat_t packrat;
   mpc_pdata_not_t not;
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
@@ -891,6 +1198,8 @@ typedef union {
 struct mpc_parser_t {
   char retained;
   char *name;
+  int id;
+  int flags;
   char type;
   mpc_pdata_t data;
 };
@@ -907,11 +1216,18 @@ static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { r
 
 static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
   int j;
-  size_t l = 0;
+  size_t l = 0, m;
   if (n == 0) { return mpc_calloc(i, 1, 1); }
   for (j = 0; j < n; j++) { l += strlen(xs[j]); }
+  m = strlen(xs[0]);
   xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
+  for (j = 1; j < n; j++) {
+    l = strlen(xs[j]);
+    memcpy((char*)xs[0] + m, xs[j], l);
+    m += l;
+    mpc_free(i, xs[j]);
+  }
+  ((char*)xs[0])[m] = '\0';
   return xs[0];
 }
 
@@ -926,6 +1242,7 @@ static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
 
 static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
   int j;
+  if (i->spanning)         { return NULL; }
   if (f == mpcf_null)      { return mpcf_null(n, xs); }
   if (f == mpcf_fst)       { return mpcf_fst(n, xs); }
   if (f == mpcf_snd)       { return mpcf_snd(n, xs); }
@@ -951,553 +1268,1237 @@ static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
 }
 
 static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
+  if (i->spanning)        { return NULL; }
   if (f == mpcf_free)     { return mpcf_input_free(i, x); }
   if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
   return f(mpc_export(i, x));
 }
 
-static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
-  return f(mpc_export(i, x), d);
+/* An `apply_to` may first apply `g`, which `mpc_optimise` merged into it */
+static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, const mpc_pdata_apply_to_t *a, mpc_val_t *x) {
+  if (i->spanning) { return NULL; }
+  if (a->g) { x = mpc_parse_apply(i, a->g, x); }
+  return a->f(mpc_export(i, x), a->d);
+}
+
+static mpc_val_t *mpc_parse_lift(mpc_input_t *i, mpc_ctor_t f) {
+  return i->spanning ? NULL : f();
 }
 
 static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
+  if (i->spanning) { return; }
   if (d == free) { mpc_free(i, x); return; }
   d(mpc_export(i, x));
 }
 
-enum {
-  MPC_PARSE_STACK_MIN = 4
-};
+/*
+** Failures
+**
+** Most errors raised while parsing are thrown
+** away once another alternative matches, so
+** rather than being built as they are raised
+** each is recorded on the input as the parser
+** which raised it and where. Only those at the
+** furthest position reached are kept, as no
+** others could ever be reported, and the error
+** is only built from them once the whole parse
+** has failed.
+**
+** An `expect` records its message, a `fail` or
+** undefined parser its failure, a `not` that
+** it expected the opposite, and a DFA each of
+** the things the state it died in expected,
+** the one numbered `s` in each record. When a
+** `many1` or `count` does not match it records
+** that it wraps the failure of its parser in
+** its own message, which is always the record
+** just before. A parser which could not be run
+** as the parse was already too deep (`s` is -1)
+** replaces all the others, and once recorded
+** nothing more is.
+**
+** While parsing the error a parser fails with
+** is `&mpc_err_recorded` if it is the newest
+** record, and NULL if it was never recorded or
+** was dropped as it was not far enough along.
+*/
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+static mpc_err_t mpc_err_recorded;
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+static mpc_err_t *mpc_input_fail_push(mpc_input_t *i, const mpc_fail_t *f) {
   
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+  if (i->exceeded) { return NULL; }
   
-  switch (p->type) {
-      
-    /* Basic Parsers */
-
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-    
-    /* Other parsers */
-    
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
-    
-    /* Application Parsers */
-    
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
-    
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
-    
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
-    
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e)) {      
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
-    
-    /* Optional Parsers */
-    
-    /* TODO: Update Not Error Message */
-    
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
-    
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
-    
-    /* Repeat Parsers */
-    
-    case MPC_TYPE_MANY:
-      
-      results = results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
-      
-      *e = mpc_err_merge(i, *e, results[j].error);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-    
-    case MPC_TYPE_MANY1:
-      
-      results = results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
-      
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        *e = mpc_err_merge(i, *e, results[j].error);
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
-    
-    case MPC_TYPE_COUNT:
-      
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
-      
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
-        }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });  
-      }
-      
-    /* Combinatory Parsers */
-    
-    case MPC_TYPE_OR:
-      
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
-      
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
-      
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        } 
-      }
-      
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-    
-    case MPC_TYPE_AND:
-      
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
-      
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
-      
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        }
-      }
-      mpc_input_unmark(i); 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-    
-    /* End */
-    
-    default:
-      
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+  if (i->fails_num > 0) {
+    if (f->state.pos < i->fails[0].state.pos) { return NULL; }
+    if (f->state.pos > i->fails[0].state.pos) { i->fails_num = 0; }
   }
   
-  return 0;
+  if (i->fails_num == i->fails_slots) {
+    i->fails_slots *= 2;
+    i->fails = realloc(i->fails, sizeof(mpc_fail_t) * i->fails_slots);
+  }
   
+  i->fails[i->fails_num++] = *f;
+  return &mpc_err_recorded;
 }
 
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMITIVE
+static int mpc_fail_expects(mpc_parser_t *p) {
+  return p->type == MPC_TYPE_EXPECT || p->type == MPC_TYPE_NOT || p->type == MPC_TYPE_DFA;
+}
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
-  e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e);
-  if (x) {
-    mpc_err_delete_internal(i, e);
-    r->output = mpc_export(i, r->output);
-  } else {
-    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
-  }
-  return x;
+static int mpc_fail_wraps(mpc_parser_t *p) {
+  return p->type == MPC_TYPE_MANY1 || p->type == MPC_TYPE_COUNT;
 }
 
-int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_string(filename, string);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static mpc_err_t *mpc_input_fail(mpc_input_t *i, mpc_parser_t *p, int s) {
+  
+  mpc_fail_t f;
+  
+  if (i->suppress || i->exceeded) { return NULL; }
+  if (i->fails_num > 0 && i->state.pos < i->fails[0].state.pos) { return NULL; }
+  
+  f.state = i->state;
+  f.p = p;
+  f.s = s;
+  f.recieved = mpc_fail_expects(p) ? mpc_input_peekc(i) : ' ';
+  return mpc_input_fail_push(i, &f);
 }
 
-int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static void mpc_input_fail_depth(mpc_input_t *i, mpc_parser_t *p) {
+  if (i->exceeded) { return; }
+  i->fails_num = 1;
+  i->fails[0].state = i->state;
+  i->fails[0].p = p;
+  i->fails[0].s = -1;
+  i->fails[0].recieved = ' ';
+  i->exceeded = 1;
 }
 
-int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
+static mpc_err_t *mpc_input_fail_wrap(mpc_input_t *i, mpc_parser_t *p, mpc_err_t *x) {
+  mpc_fail_t f;
+  if (x == NULL) { return NULL; }
+  f = i->fails[i->fails_num-1];
+  f.p = p;
+  f.s = 0;
+  return mpc_input_fail_push(i, &f);
 }
 
-int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
-  
-  FILE *f = fopen(filename, "rb");
-  int res;
-  
-  if (f == NULL) {
-    r->output = NULL;
-    r->error = mpc_err_file(filename, "Unable to open file!");
-    return 0;
+static const char *mpc_fail_failure(const mpc_fail_t *f) {
+  if (f->s < 0) { return "Maximum Parse Depth Exceeded!"; }
+  switch (f->p->type) {
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_DFA:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:     return NULL;
+    case MPC_TYPE_UNDEFINED: return "Parser Undefined!";
+    case MPC_TYPE_FAIL:      return f->p->data.fail.m;
+    default:                 return "Unknown Parser Type Id!";
   }
-  
-  res = mpc_parse_file(filename, f, p, r);
-  fclose(f);
-  return res;
 }
 
-/*
-** Building a Parser
-*/
-
-static void mpc_undefine_unretained(mpc_parser_t *p, int force);
-
-static void mpc_undefine_or(mpc_parser_t *p) {
+static char *mpc_fail_expected(const mpc_fail_t *f) {
   
-  int i;
-  for (i = 0; i < p->data.or.n; i++) {
-    mpc_undefine_unretained(p->data.or.xs[i], 0);
-  }
-  free(p->data.or.xs);
+  const char *x = "opposite";
+  char *y;
   
+  if (f->p->type == MPC_TYPE_EXPECT) { x = f->p->data.expect.m; }
+  if (f->p->type == MPC_TYPE_DFA) { x = f->p->data.dfa.d->expected[f->s]; }
+  
+  y = malloc(strlen(x) + 1);
+  strcpy(y, x);
+  return y;
 }
 
-static void mpc_undefine_and(mpc_parser_t *p) {
+static char *mpc_fail_wrap(const mpc_fail_t *f, char *x) {
   
-  int i;
-  for (i = 0; i < p->data.and.n; i++) {
-    mpc_undefine_unretained(p->data.and.xs[i], 0);
+  char prefix[32];
+  char *y;
+  
+  if (f->p->type == MPC_TYPE_COUNT) {
+    sprintf(prefix, "%i of ", f->p->data.repeat.n);
+  } else {
+    strcpy(prefix, "one or more of ");
   }
-  free(p->data.and.xs);
-  free(p->data.and.dxs);
   
+  y = malloc(strlen(prefix) + strlen(x) + 1);
+  strcpy(y, prefix);
+  strcat(y, x);
+  free(x);
+  return y;
 }
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+static mpc_err_t *mpc_input_fails_error(mpc_input_t *i) {
   
-  if (p->retained && !force) { return; }
+  int j, k, n;
+  char *x;
+  const char *failure;
+  mpc_err_t *e = malloc(sizeof(mpc_err_t));
   
-  switch (p->type) {
-    
-    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+  e->filename = malloc(strlen(i->filename) + 1);
+  strcpy(e->filename, i->filename);
+  e->state = mpc_state_invalid();
+  e->expected_num = 0;
+  e->expected = NULL;
+  e->failure = NULL;
+  e->recieved = ' ';
+  
+  if (i->fails_num == 0) {
+    e->failure = malloc(strlen("Unknown Error") + 1);
+    strcpy(e->failure, "Unknown Error");
+    return e;
+  }
+  
+  e->state = i->fails[0].state;
+  
+  for (j = 0; j < i->fails_num; j = k) {
     
-    case MPC_TYPE_ONEOF: 
-    case MPC_TYPE_NONEOF:
-    case MPC_TYPE_STRING:
-      free(p->data.string.x); 
+    for (k = j + 1; k < i->fails_num && mpc_fail_wraps(i->fails[k].p); k++);
+    
+    failure = mpc_fail_failure(&i->fails[j]);
+    if (failure) {
+      e->failure = malloc(strlen(failure) + 1);
+      strcpy(e->failure, failure);
       break;
+    }
     
-    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
-    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
-    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    x = mpc_fail_expected(&i->fails[j]);
+    for (n = j + 1; n < k; n++) { x = mpc_fail_wrap(&i->fails[n], x); }
     
-    case MPC_TYPE_MAYBE:
-    case MPC_TYPE_NOT:
-      mpc_undefine_unretained(p->data.not.x, 0);
-      break;
+    e->recieved = i->fails[j].recieved;
     
-    case MPC_TYPE_EXPECT:
-      mpc_undefine_unretained(p->data.expect.x, 0);
-      free(p->data.expect.m);
-      break;
-      
-    case MPC_TYPE_MANY:
-    case MPC_TYPE_MANY1:
-    case MPC_TYPE_COUNT:
-      mpc_undefine_unretained(p->data.repeat.x, 0);
-      break;
+    for (n = 0; n < e->expected_num; n++) {
+      if (strcmp(e->expected[n], x) == 0) { break; }
+    }
     
-    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
-    case MPC_TYPE_AND: mpc_undefine_and(p); break;
+    if (n < e->expected_num) { free(x); continue; }
     
-    default: break;
-  }
-  
-  if (!force) {
-    free(p->name);
-    free(p);
+    e->expected_num++;
+    e->expected = realloc(e->expected, sizeof(char*) * e->expected_num);
+    e->expected[e->expected_num-1] = x;
   }
   
+  return e;
 }
 
-void mpc_delete(mpc_parser_t *p) {
-  if (p->retained) {
+/*
+** DFA Matching
+**
+** The table is run until it dies or the input
+** ends and the match is the input up to the
+** last accepting state. Like the combinators
+** it reports what it expected where it died,
+** even after a match. For string input this
+** is a tight loop over the bytes themselves
+** and the state is only advanced at the end.
+*/
 
-    if (p->type != MPC_TYPE_UNDEFINED) {
-      mpc_undefine_unretained(p, 0);
-    } 
-    
-    free(p->name);
-    free(p);
+static void mpc_input_string_advance(mpc_input_t *i, long n) {
   
-  } else {
-    mpc_undefine_unretained(p, 0);  
+  const char *x = i->string + i->state.pos;
+  const char *end = x + n;
+  
+  if (n == 0) { return; }
+  
+  i->state.pos += n;
+  i->last = end[-1];
+  
+  while (x < end) {
+    if (*x == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    } else {
+      i->state.col++;
+    }
+    x++;
   }
 }
 
-static void mpc_soft_delete(mpc_val_t *x) {
-  mpc_undefine_unretained(x, 0);
+static mpc_err_t *mpc_input_dfa_error(mpc_input_t *i, mpc_parser_t *p, int s) {
+  
+  const mpc_dfa_t *d = p->data.dfa.d;
+  mpc_err_t *err = NULL;
+  int k;
+  
+  if (i->suppress) { return NULL; }
+  for (k = d->at[s]; k < d->at[s+1]; k++) { err = mpc_input_fail(i, p, k); }
+  return d->returns[s] ? err : NULL;
 }
 
-static mpc_parser_t *mpc_undefined(void) {
-  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
-  p->retained = 0;
-  p->type = MPC_TYPE_UNDEFINED;
-  p->name = NULL;
-  return p;
+static int mpc_input_dfa(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  
+  const mpc_dfa_t *d = p->data.dfa.d;
+  const unsigned char *x;
+  long k, pos, end, acc;
+  int s = d->start, t, accepted;
+  mpc_state_t state;
+  mpc_err_t *err = NULL;
+  char c, last;
+  
+  if (i->type == MPC_INPUT_STRING) {
+    
+    x = (const unsigned char*)i->string;
+    pos = i->state.pos;
+    end = (long)i->length;
+    acc = d->accept[s] ? pos : -1;
+    
+    for (k = pos; k < end; k++) {
+      t = d->trans[s * 256 + x[k]];
+      if (t < 0) { break; }
+      s = t;
+      if (d->accept[s]) { acc = k + 1; }
+    }
+    
+    accepted = acc >= 0;
+    if (!accepted) { acc = pos; }
+    mpc_input_string_advance(i, acc - pos);
+    
+    if (!i->suppress) {
+      state = i->state;
+      last = i->last;
+      mpc_input_string_advance(i, k - acc);
+      err = mpc_input_dfa_error(i, p, s);
+      i->state = state;
+      i->last = last;
+    }
+    
+    if (!accepted) {
+      r->error = err;
+      return 0;
+    }
+    
+    if (i->spanning) {
+      r->output = NULL;
+    } else {
+      r->output = mpc_malloc(i, (size_t)(acc - pos) + 1);
+      memcpy(r->output, i->string + pos, (size_t)(acc - pos));
+      ((char*)r->output)[acc - pos] = '\0';
+    }
+    
+    return 1;
+  }
+  
+  /* Files and pipes go a character at a time */
+  
+  mpc_input_span_begin(i);
+  accepted = d->accept[s];
+  state = i->state;
+  last = i->last;
+  
+  while (1) {
+    c = mpc_input_getc(i);
+    if (mpc_input_terminated(i)) { break; }
+    t = d->trans[s * 256 + (unsigned char)c];
+    if (t < 0) { mpc_input_failure(i, c); break; }
+    mpc_input_success(i, c, NULL);
+    s = t;
+    if (d->accept[s]) {
+      accepted = 1;
+      state = i->state;
+      last = i->last;
+    }
+  }
+  
+  err = mpc_input_dfa_error(i, p, s);
+  
+  if (i->state.pos != state.pos) {
+    i->state = state;
+    i->last = last;
+    if (i->type == MPC_INPUT_FILE) {
+      fseek(i->file, i->state.pos, SEEK_SET);
+    }
+  }
+  
+  if (!accepted) {
+    mpc_input_span_end(i, 0);
+    r->error = err;
+    return 0;
+  }
+  
+  r->output = mpc_input_span_end(i, 1);
+  return 1;
 }
 
-mpc_parser_t *mpc_new(const char *name) {
-  mpc_parser_t *p = mpc_undefined();
-  p->retained = 1;
-  p->name = realloc(p->name, strlen(name) + 1);
-  strcpy(p->name, name);
-  return p;
+/*
+** Packrat Parsing
+**
+** The first time a packrat parser is run at a
+** position the memo records whether it matched
+** and where it ended, or if not the errors it
+** raised, so that running it there again skips
+** straight to the outcome. Results are owned by
+** whoever takes them, so one is only kept once
+** it is asked for again: that time the parser
+** is rerun, which is cheap as everything under
+** it is already memoised, and a copy is kept
+** to hand out from then on. `mpca_lang` puts
+** these around each rule reference, keyed by
+** the rule so every reference to it shares one
+** memo, and its copies of the AST are shared
+** rather than duplicated. Nothing is stored
+** when there are no marks, as then the input
+** can never come back, nor while spanning or
+** with errors suppressed, as results there are
+** incomplete.
+*/
+
+static mpc_err_t *mpc_input_fails_load(mpc_input_t *i, mpc_memo_t *m) {
+  int j;
+  mpc_err_t *x = NULL;
+  for (j = 0; j < m->fails_num; j++) { x = mpc_input_fail_push(i, &m->fails[j]); }
+  return m->error ? x : NULL;
 }
 
-mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
-  mpc_undefine_unretained(p, 1);
-  p->type = MPC_TYPE_UNDEFINED;
-  return p;
+/* Keeps what was recorded since there were `n` records at `far` */
+static void mpc_input_fails_save(mpc_input_t *i, mpc_memo_t *m, int n, long far) {
+  if (i->fails_num > 0 && i->fails[0].state.pos != far) { n = 0; }
+  if (n >= i->fails_num) { return; }
+  m->fails_num = i->fails_num - n;
+  m->fails = malloc(sizeof(mpc_fail_t) * m->fails_num);
+  memcpy(m->fails, i->fails + n, sizeof(mpc_fail_t) * m->fails_num);
 }
 
-mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+/*
+** Gives the outcome of the packrat parser of
+** frame `f` if it is known here. Otherwise it
+** must be run, and `f` notes what is needed to
+** remember it afterwards, if it is to be.
+*/
+
+static int mpc_parse_packrat_recall(mpc_input_t *i, mpc_frame_t *f, mpc_result_t *r, int *x) {
   
-  if (p->retained) {
-    p->type = a->type;
-    p->data = a->data;
-  } else {
-    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
-    p->type = a2->type;
-    p->data = a2->data;
-    free(a2);
+  mpc_pdata_packrat_t *d = &f->p->data.packrat;
+  mpc_memo_t *m;
+  
+  f->n = 0;
+  f->m = NULL;
+  
+  if (i->spanning || i->suppress) { return 0; }
+  
+  m = mpc_input_memo_get(i, d->key);
+  
+  if (m && !m->success) {
+    r->error = mpc_input_fails_load(i, m);
+    *x = 0;
+    return 1;
   }
   
-  free(a);
-  return p;  
+  if (m && m->kept) {
+    mpc_input_fails_load(i, m);
+    i->state = m->state;
+    i->last = m->last;
+    if (i->type == MPC_INPUT_FILE) {
+      fseek(i->file, i->state.pos, SEEK_SET);
+    }
+    if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
+      mpc_input_buffer_discard(i);
+    }
+    r->output = d->copy(m->output);
+    *x = 1;
+    return 1;
+  }
+  
+  if (i->marks_num == 0) { return 0; }
+  
+  f->n = 1;
+  f->m = m;
+  f->pos = i->state.pos;
+  f->far = i->fails_num > 0 ? i->fails[0].state.pos : -1;
+  f->k = i->fails_num;
+  return 0;
 }
 
-void mpc_cleanup(int n, ...) {
-  int i;
-  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+static void mpc_parse_packrat_store(mpc_input_t *i, mpc_frame_t *f, mpc_result_t *r, int x) {
   
-  va_list va;
-  va_start(va, n);
-  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
-  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
-  for (i = 0; i < n; i++) { mpc_delete(list[i]); }  
-  va_end(va);  
-
-  free(list);
+  mpc_pdata_packrat_t *d = &f->p->data.packrat;
+  mpc_memo_t *m = f->m;
+  
+  if (!f->n) { return; }
+  
+  if (m && x) {
+    m->kept = 1;
+    m->output = d->copy(r->output);
+    mpc_input_fails_save(i, m, f->k, f->far);
+  }
+  
+  if (m == NULL) {
+    m = malloc(sizeof(mpc_memo_t));
+    m->p = d->key;
+    m->pos = f->pos;
+    m->success = x;
+    m->kept = 0;
+    m->state = i->state;
+    m->last = i->last;
+    m->output = NULL;
+    m->dx = d->dx;
+    m->error = !x && r->error != NULL;
+    m->fails_num = 0;
+    m->fails = NULL;
+    if (!x) { mpc_input_fails_save(i, m, f->k, f->far); }
+    mpc_input_memo_put(i, m);
+  }
 }
 
-mpc_parser_t *mpc_pass(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PASS;
-  return p;
-}
+/*
+** Dispatch
+**
+** An `or` given a table by `mpc_analyse` only
+** tries the alternatives which could match the
+** next character. The errors of the others are
+** still given, as they would have been raised,
+** unless errors are suppressed anyway. Should
+** an alternative fail without giving back the
+** input it took, as a predictive one can, the
+** rest are looked up again from where it left
+** the input.
+*/
 
-mpc_parser_t *mpc_fail(const char *m) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
-  p->data.fail.m = malloc(strlen(m) + 1);
-  strcpy(p->data.fail.m, m);
-  return p;
+static void mpc_parse_dispatch_start(mpc_input_t *i, mpc_frame_t *f, mpc_dispatch_t *d) {
+  int c = mpc_input_terminated(i) ? 256 : (unsigned char)mpc_input_peekc(i);
+  f->pos = i->state.pos;
+  f->k = d->start[c];
+  f->n = d->start[c+1];
+  while (f->k < f->n && d->alts[f->k] < f->j) { f->k++; }
+}
+
+static void mpc_parse_dispatch_recall(mpc_input_t *i, mpc_dispatch_t *d, int j) {
+  int k;
+  char c = mpc_input_peekc(i);
+  mpc_fail_t f;
+  for (k = d->at[j]; k < d->at[j+1]; k++) {
+    f = d->fails[k];
+    f.state = i->state;
+    f.recieved = c;
+    mpc_input_fail_push(i, &f);
+  }
 }
 
 /*
-** As `snprintf` is not ANSI standard this 
-** function `mpc_failf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to 
-**   use `snprintf` or whatever variant your
-**   system supports.
+** The Parse Stack
 **
-** - Avoid it altogether.
+** Parsers are not run by recursing but on a
+** stack of frames kept with the input, so how
+** deeply they nest is only limited by memory,
+** or by the limit set on that input with
+** `mpc_input_depth_limit`. Each step takes the
+** frame on top, either as it is entered or as
+** it is resumed with the outcome (`x` and `r`)
+** of the parser it ran, and then either runs
+** another parser, pushing its frame, or ends,
+** popping its own. The results an `and` or a
+** repeat has collected so far are kept on one
+** more stack until they are folded together.
 **
+** Should the stack get too deep the parse is
+** abandoned, and every frame is unwound as if
+** the parser it ran had failed.
 */
 
-mpc_parser_t *mpc_failf(const char *fmt, ...) {
-  
-  va_list va;
-  char *buffer;
-
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
-  
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
-  
-  buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.fail.m = buffer;
-  return p;
-
-}
+enum {
+  MPC_PARSE_CALL   = 0,
+  MPC_PARSE_RETURN = 1
+};
 
-mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT_VAL;
-  p->data.lift.x = x;
-  return p;
+int mpc_input_depth_limit(mpc_input_t *i, int depth) {
+  int previous = i->frames_max;
+  i->frames_max = depth;
+  return previous;
 }
 
-mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT;
-  p->data.lift.lf = lf;
-  return p;
+static int mpc_parse_push(mpc_input_t *i, mpc_parser_t *p) {
+  
+  if (i->frames_max > 0 && i->frames_num >= i->frames_max) {
+    mpc_input_fail_depth(i, p);
+    return 0;
+  }
+  
+  if (i->frames_num == i->frames_slots) {
+    i->frames_slots *= 2;
+    i->frames = realloc(i->frames, sizeof(mpc_frame_t) * i->frames_slots);
+  }
+  
+  i->frames[i->frames_num].p = p;
+  i->frames[i->frames_num].j = 0;
+  i->frames_num++;
+  return 1;
 }
 
-mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ANCHOR;
-  p->data.anchor.f = f;
-  return mpc_expect(p, "anchor");
+static void mpc_parse_keep(mpc_input_t *i, mpc_val_t *x) {
+  if (i->vals_num == i->vals_slots) {
+    i->vals_slots *= 2;
+    i->vals = realloc(i->vals, sizeof(mpc_val_t*) * i->vals_slots);
+  }
+  i->vals[i->vals_num++] = x;
 }
 
-mpc_parser_t *mpc_state(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_STATE;
-  return p;
+static mpc_val_t *mpc_parse_fold_kept(mpc_input_t *i, mpc_fold_t f, int n) {
+  mpc_val_t *x = mpc_parse_fold(i, f, n, i->vals + i->vals_num - n);
+  i->vals_num -= n;
+  return x;
 }
 
-mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
-  p->data.expect.x = a;
-  p->data.expect.m = malloc(strlen(expected) + 1);
-  strcpy(p->data.expect.m, expected);
-  return p;
+/* Deletes the last `n` results kept, with `ds[k]` for each, or `d` for all */
+static void mpc_parse_drop_kept(mpc_input_t *i, mpc_dtor_t d, mpc_dtor_t *ds, int n) {
+  int k, base = i->vals_num - n;
+  for (k = 0; k < n; k++) {
+    mpc_parse_dtor(i, ds ? ds[k] : d, i->vals[base + k]);
+  }
+  i->vals_num = base;
 }
 
 /*
-** As `snprintf` is not ANSI standard this 
-** function `mpc_expectf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
+** Unwinds frame `f` once the parse has been
+** abandoned. If `x` is set then `r` holds what
+** the parser it ran made, which is deleted if
+** `f` knows how, and otherwise handed on as it
+** would have been to whatever would delete it.
+** If that is nothing, as the outermost parser
+** is a `many` say, it is lost, as are results
+** given a destructor which does nothing, as
+** `mpc_tok` gives them, assuming it can't fail.
+*/
+
+static void mpc_parse_unwind(mpc_input_t *i, mpc_frame_t *f, mpc_result_t *r, int *x) {
+  
+  mpc_parser_t *p = f->p;
+  
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:  mpc_input_suppress_disable(i); break;
+    case MPC_TYPE_PREDICT: mpc_input_backtrack_enable(i); break;
+    
+    case MPC_TYPE_SPAN:
+      mpc_input_span_end(i, 0);
+      *x = 0;
+      break;
+    
+    case MPC_TYPE_APPLY:
+      if (*x) { r->output = mpc_parse_apply(i, p->data.apply.f, r->output); }
+      break;
+    
+    case MPC_TYPE_APPLY_TO:
+      if (*x) { r->output = mpc_parse_apply_to(i, &p->data.apply_to, r->output); }
+      break;
+    
+    case MPC_TYPE_NOT:
+      mpc_input_unmark(i);
+      mpc_input_suppress_disable(i);
+      if (*x) { mpc_parse_dtor(i, p->data.not.dx, r->output); }
+      *x = 0;
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (*x) { mpc_parse_keep(i, r->output); f->j++; }
+      if (f->j > 0) { r->output = mpc_parse_fold_kept(i, p->data.repeat.f, f->j); }
+      *x = f->j > 0;
+      break;
+    
+    case MPC_TYPE_COUNT:
+      if (*x) { mpc_parse_keep(i, r->output); f->j++; }
+      mpc_parse_drop_kept(i, p->data.repeat.dx, NULL, f->j);
+      *x = 0;
+      break;
+    
+    case MPC_TYPE_AND:
+      mpc_input_rewind(i);
+      if (*x) { mpc_parse_keep(i, r->output); f->j++; }
+      if (f->j == p->data.and.n) {
+        r->output = mpc_parse_fold_kept(i, p->data.and.f, f->j);
+      } else {
+        mpc_parse_drop_kept(i, NULL, p->data.and.dxs, f->j);
+        *x = 0;
+      }
+      break;
+    
+    default: break;
+  }
+}
+
+#define MPC_CALL(y) *q = y; return MPC_PARSE_CALL
+#define MPC_RETURN() return MPC_PARSE_RETURN
+#define MPC_SUCCESS(y) r->output = y; *x = 1; return MPC_PARSE_RETURN
+#define MPC_FAILURE(y) r->error = y; *x = 0; return MPC_PARSE_RETURN
+#define MPC_PRIMITIVE(y) \
+  if (y) { *x = 1; } \
+  else { r->error = NULL; *x = 0; } \
+  return MPC_PARSE_RETURN
+
+static int mpc_parse_step(mpc_input_t *i, mpc_frame_t *f, int resume, int *x, mpc_result_t *r, mpc_parser_t **q) {
+  
+  mpc_parser_t *p = f->p;
+  mpc_dispatch_t *d;
+  int k;
+  
+  switch (p->type) {
+      
+    /* Basic Parsers */
+
+    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
+    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
+    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
+    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.oneof.s, (char**)&r->output));
+    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.oneof.s, (char**)&r->output));
+    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
+    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+    
+    case MPC_TYPE_DFA:
+      *x = mpc_input_dfa(i, p, r);
+      MPC_RETURN();
+    
+    case MPC_TYPE_PACKRAT:
+      if (!resume) {
+        if (mpc_parse_packrat_recall(i, f, r, x)) { MPC_RETURN(); }
+        MPC_CALL(p->data.packrat.x);
+      }
+      mpc_parse_packrat_store(i, f, r, *x);
+      MPC_RETURN();
+    
+    /* Other parsers */
+    
+    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_input_fail(i, p, 0));
+    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_input_fail(i, p, 0));
+    case MPC_TYPE_LIFT:      MPC_SUCCESS(mpc_parse_lift(i, p->data.lift.lf));
+    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+    
+    /* Application Parsers */
+    
+    case MPC_TYPE_APPLY:
+      if (!resume) { MPC_CALL(p->data.apply.x); }
+      if (*x) { MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output)); }
+      MPC_RETURN();
+    
+    case MPC_TYPE_APPLY_TO:
+      if (!resume) { MPC_CALL(p->data.apply_to.x); }
+      if (*x) { MPC_SUCCESS(mpc_parse_apply_to(i, &p->data.apply_to, r->output)); }
+      MPC_RETURN();
+    
+    case MPC_TYPE_EXPECT:
+      if (!resume) {
+        mpc_input_suppress_enable(i);
+        MPC_CALL(p->data.expect.x);
+      }
+      mpc_input_suppress_disable(i);
+      if (*x) { MPC_RETURN(); }
+      MPC_FAILURE(mpc_input_fail(i, p, 0));
+    
+    case MPC_TYPE_PREDICT:
+      if (!resume) {
+        mpc_input_backtrack_disable(i);
+        MPC_CALL(p->data.predict.x);
+      }
+      mpc_input_backtrack_enable(i);
+      MPC_RETURN();
+    
+    case MPC_TYPE_SPAN:
+      if (!resume) {
+        mpc_input_span_begin(i);
+        MPC_CALL(p->data.span.x);
+      }
+      if (*x) { MPC_SUCCESS(mpc_input_span_end(i, 1)); }
+      mpc_input_span_end(i, 0);
+      MPC_RETURN();
+    
+    /* Optional Parsers */
+    
+    /* TODO: Update Not Error Message */
+    
+    case MPC_TYPE_NOT:
+      if (!resume) {
+        mpc_input_mark(i);
+        mpc_input_suppress_enable(i);
+        MPC_CALL(p->data.not.x);
+      }
+      if (*x) {
+        mpc_input_rewind(i);
+        mpc_input_suppress_disable(i);
+        mpc_parse_dtor(i, p->data.not.dx, r->output);
+        MPC_FAILURE(mpc_input_fail(i, p, 0));
+      }
+      mpc_input_unmark(i);
+      mpc_input_suppress_disable(i);
+      MPC_SUCCESS(mpc_parse_lift(i, p->data.not.lf));
+    
+    case MPC_TYPE_MAYBE:
+      if (!resume) { MPC_CALL(p->data.not.x); }
+      if (*x) { MPC_RETURN(); }
+      MPC_SUCCESS(mpc_parse_lift(i, p->data.not.lf));
+    
+    /* Repeat Parsers */
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (!resume) { MPC_CALL(p->data.repeat.x); }
+      if (*x) {
+        mpc_parse_keep(i, r->output);
+        f->j++;
+        MPC_CALL(p->data.repeat.x);
+      }
+      if (p->type == MPC_TYPE_MANY1 && f->j == 0) {
+        MPC_FAILURE(mpc_input_fail_wrap(i, p, r->error));
+      }
+      MPC_SUCCESS(mpc_parse_fold_kept(i, p->data.repeat.f, f->j));
+    
+    case MPC_TYPE_COUNT:
+      if (!resume) { MPC_CALL(p->data.repeat.x); }
+      if (*x) {
+        mpc_parse_keep(i, r->output);
+        f->j++;
+        if (f->j != p->data.repeat.n) { MPC_CALL(p->data.repeat.x); }
+        MPC_SUCCESS(mpc_parse_fold_kept(i, p->data.repeat.f, f->j));
+      }
+      mpc_parse_drop_kept(i, p->data.repeat.dx, NULL, f->j);
+      MPC_FAILURE(mpc_input_fail_wrap(i, p, r->error));
+    
+    /* Combinatory Parsers */
+    
+    case MPC_TYPE_OR:
+      
+      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+      if (resume && *x) { MPC_RETURN(); }
+      
+      d = p->data.or.d;
+      
+      if (d == NULL) {
+        if (f->j < p->data.or.n) { MPC_CALL(p->data.or.xs[f->j++]); }
+        MPC_FAILURE(NULL);
+      }
+      
+      if (!resume) { f->pos = -1; }
+      
+      while (f->j < p->data.or.n) {
+        if (i->state.pos != f->pos) { mpc_parse_dispatch_start(i, f, d); }
+        k = f->j++;
+        if (f->k < f->n && d->alts[f->k] == k) {
+          f->k++;
+          MPC_CALL(p->data.or.xs[k]);
+        }
+        if (!i->suppress) { mpc_parse_dispatch_recall(i, d, k); }
+      }
+      
+      MPC_FAILURE(NULL);
+    
+    case MPC_TYPE_AND:
+      
+      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+      
+      if (!resume) {
+        mpc_input_mark(i);
+        MPC_CALL(p->data.and.xs[0]);
+      }
+      
+      if (!*x) {
+        mpc_input_rewind(i);
+        mpc_parse_drop_kept(i, NULL, p->data.and.dxs, f->j);
+        MPC_RETURN();
+      }
+      
+      mpc_parse_keep(i, r->output);
+      f->j++;
+      if (f->j < p->data.and.n) { MPC_CALL(p->data.and.xs[f->j]); }
+      mpc_input_unmark(i);
+      MPC_SUCCESS(mpc_parse_fold_kept(i, p->data.and.f, f->j));
+    
+    /* End */
+    
+    default:
+      
+      MPC_FAILURE(mpc_input_fail(i, p, 0));
+  }
+  
+}
+
+#undef MPC_CALL
+#undef MPC_RETURN
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMITIVE
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  
+  int base = i->frames_num;
+  int x = 0, resume = 0, step;
+  mpc_parser_t *q;
+  mpc_frame_t *f;
+  
+  if (!mpc_parse_push(i, p)) {
+    r->error = NULL;
+    return 0;
+  }
+  
+  while (1) {
+    
+    f = &i->frames[i->frames_num-1];
+    
+    if (resume && i->exceeded) {
+      mpc_parse_unwind(i, f, r, &x);
+      step = MPC_PARSE_RETURN;
+    } else {
+      step = mpc_parse_step(i, f, resume, &x, r, &q);
+    }
+    
+    if (step == MPC_PARSE_CALL) {
+      resume = !mpc_parse_push(i, q);
+      if (resume) {
+        r->error = NULL;
+        x = 0;
+      }
+      continue;
+    }
+    
+    i->frames_num--;
+    if (i->frames_num > base) {
+      resume = 1;
+      continue;
+    }
+    
+    if (i->exceeded) {
+      r->error = NULL;
+      return 0;
+    }
+    
+    return x;
+  }
+  
+}
+
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  i->fails_num = 0;
+  i->exceeded = 0;
+  x = mpc_parse_run(i, p, r);
+  mpc_input_memo_clear(i);
+  if (x) {
+    r->output = mpc_export(i, r->output);
+  } else {
+    r->error = mpc_input_fails_error(i);
+  }
+  return x;
+}
+
+int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_file(filename, file);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+  
+  FILE *f;
+  int res;
+  
+#ifdef MPC_USE_MMAP
+  mpc_input_t *i;
+  int fd = open(filename, O_RDONLY);
+  
+  if (fd >= 0) {
+    i = mpc_input_new_mapped(filename, fd);
+    close(fd);
+    if (i) {
+      res = mpc_parse_input(i, p, r);
+      mpc_input_delete(i);
+      return res;
+    }
+  }
+#endif
+  
+  f = fopen(filename, "rb");
+  
+  if (f == NULL) {
+    r->output = NULL;
+    r->error = mpc_err_file(filename, "Unable to open file!");
+    return 0;
+  }
+  
+  res = mpc_parse_file(filename, f, p, r);
+  fclose(f);
+  return res;
+}
+
+/*
+** Building a Parser
+*/
+
+static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+
+static void mpc_undefine_or(mpc_parser_t *p) {
+  
+  int i;
+  for (i = 0; i < p->data.or.n; i++) {
+    mpc_undefine_unretained(p->data.or.xs[i], 0);
+  }
+  free(p->data.or.xs);
+  mpc_dispatch_delete(p->data.or.d);
+  
+}
+
+static void mpc_undefine_and(mpc_parser_t *p) {
+  
+  int i;
+  for (i = 0; i < p->data.and.n; i++) {
+    mpc_undefine_unretained(p->data.and.xs[i], 0);
+  }
+  free(p->data.and.xs);
+  free(p->data.and.dxs);
+  
+}
+
+static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+  
+  if (p->retained && !force) { return; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+    
+    case MPC_TYPE_ONEOF: 
+    case MPC_TYPE_NONEOF:
+      free(p->data.oneof.x);
+      break;
+    
+    case MPC_TYPE_STRING:
+      free(p->data.string.x); 
+      break;
+    
+    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
+    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
+    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_SPAN:     mpc_undefine_unretained(p->data.span.x, 0);     break;
+    
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      mpc_dfa_delete(p->data.dfa.d);
+      break;
+    
+    case MPC_TYPE_PACKRAT: mpc_undefine_unretained(p->data.packrat.x, 0); break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      mpc_undefine_unretained(p->data.not.x, 0);
+      break;
+    
+    case MPC_TYPE_EXPECT:
+      mpc_undefine_unretained(p->data.expect.x, 0);
+      free(p->data.expect.m);
+      break;
+      
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_undefine_unretained(p->data.repeat.x, 0);
+      break;
+    
+    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
+    case MPC_TYPE_AND: mpc_undefine_and(p); break;
+    
+    default: break;
+  }
+  
+  if (!force) {
+    free(p->name);
+    free(p);
+  }
+  
+}
+
+void mpc_delete(mpc_parser_t *p) {
+  if (p->retained) {
+
+    if (p->type != MPC_TYPE_UNDEFINED) {
+      mpc_undefine_unretained(p, 0);
+    } 
+    
+    free(p->name);
+    free(p);
+  
+  } else {
+    mpc_undefine_unretained(p, 0);  
+  }
+}
+
+static void mpc_soft_delete(mpc_val_t *x) {
+  mpc_undefine_unretained(x, 0);
+}
+
+static mpc_parser_t *mpc_undefined(void) {
+  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
+  p->retained = 0;
+  p->type = MPC_TYPE_UNDEFINED;
+  p->name = NULL;
+  return p;
+}
+
+mpc_parser_t *mpc_new(const char *name) {
+  mpc_parser_t *p = mpc_undefined();
+  p->retained = 1;
+  p->name = realloc(p->name, strlen(name) + 1);
+  strcpy(p->name, name);
+  return p;
+}
+
+mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+  mpc_undefine_unretained(p, 1);
+  p->type = MPC_TYPE_UNDEFINED;
+  return p;
+}
+
+mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+  
+  if (p->retained) {
+    p->type = a->type;
+    p->data = a->data;
+  } else {
+    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
+    p->type = a2->type;
+    p->data = a2->data;
+    free(a2);
+  }
+  
+  free(a);
+  return p;  
+}
+
+void mpc_cleanup(int n, ...) {
+  int i;
+  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+  
+  va_list va;
+  va_start(va, n);
+  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
+  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
+  for (i = 0; i < n; i++) { mpc_delete(list[i]); }  
+  va_end(va);  
+
+  free(list);
+}
+
+mpc_parser_t *mpc_pass(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PASS;
+  return p;
+}
+
+mpc_parser_t *mpc_fail(const char *m) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
+  p->data.fail.m = malloc(strlen(m) + 1);
+  strcpy(p->data.fail.m, m);
+  return p;
+}
+
+/*
+** As `snprintf` is not ANSI standard this 
+** function `mpc_failf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to 
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
+*/
+
+mpc_parser_t *mpc_failf(const char *fmt, ...) {
+  
+  va_list va;
+  char *buffer;
+
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
+  
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+  
+  buffer = realloc(buffer, strlen(buffer) + 1);
+  p->data.fail.m = buffer;
+  return p;
+
+}
+
+mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT_VAL;
+  p->data.lift.x = x;
+  return p;
+}
+
+mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT;
+  p->data.lift.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ANCHOR;
+  p->data.anchor.f = f;
+  return mpc_expect(p, "anchor");
+}
+
+mpc_parser_t *mpc_state(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_STATE;
+  return p;
+}
+
+mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EXPECT;
+  p->data.expect.x = a;
+  p->data.expect.m = malloc(strlen(expected) + 1);
+  strcpy(p->data.expect.m, expected);
+  return p;
+}
+
+/*
+** As `snprintf` is not ANSI standard this 
+** function `mpc_expectf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
 **   the buffer length using precision specifiers
 **   such as `%.512s`.
 **
@@ -1552,19 +2553,25 @@ mpc_parser_t *mpc_range(char s, char e) {
   return mpc_expectf(p, "character between '%c' and '%c'", s, e);
 }
 
+/* The terminating zero is counted as one of `s`, as it always has been */
+static void mpc_oneof_set(mpc_parser_t *p, const char *s) {
+  p->data.oneof.x = malloc(strlen(s) + 1);
+  strcpy(p->data.oneof.x, s);
+  memset(p->data.oneof.s, 0, 32);
+  do { mpc_dfa_set_add(p->data.oneof.s, (unsigned char)*s); } while (*s++);
+}
+
 mpc_parser_t *mpc_oneof(const char *s) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_ONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
+  mpc_oneof_set(p, s);
   return mpc_expectf(p, "one of '%s'", s);
 }
 
 mpc_parser_t *mpc_noneof(const char *s) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
+  mpc_oneof_set(p, s);
   return mpc_expectf(p, "none of '%s'", s);
 
 }
@@ -1602,13 +2609,31 @@ mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
   p->data.apply_to.x = a;
   p->data.apply_to.f = f;
   p->data.apply_to.d = x;
+  p->data.apply_to.g = NULL;
+  return p;
+}
+
+mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PREDICT;
+  p->data.predict.x = a;
+  return p;
+}
+
+mpc_parser_t *mpc_span(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SPAN;
+  p->data.span.x = a;
   return p;
 }
 
-mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
+mpc_parser_t *mpc_packrat(mpc_parser_t *a, mpc_apply_t copy, mpc_dtor_t da) {
   mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PREDICT;
-  p->data.predict.x = a;
+  p->type = MPC_TYPE_PACKRAT;
+  p->data.packrat.x = a;
+  p->data.packrat.copy = copy;
+  p->data.packrat.dx = da;
+  p->data.packrat.key = p;
   return p;
 }
 
@@ -1673,6 +2698,7 @@ mpc_parser_t *mpc_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.d = NULL;
   
   va_start(va, n);  
   for (i = 0; i < n; i++) {
@@ -1732,7 +2758,7 @@ static int mpc_boundary_anchor(char prev, char next) {
 mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "boundary"); }
 
 mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
-mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
+mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_span(mpc_many(mpcf_strfold, mpc_whitespace())), "spaces"); }
 mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
 
 mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
@@ -1761,285 +2787,880 @@ mpc_parser_t *mpc_real(void) {
 
   /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
   
-  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+  
+  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p1 = mpc_digits();
+  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
+  p30 = mpc_oneof("eE");
+  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p32 = mpc_digits();
+  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+  
+  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+
+}
+
+mpc_parser_t *mpc_float(void) {
+  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
+}
+
+mpc_parser_t *mpc_char_lit(void) {
+  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+}
+
+mpc_parser_t *mpc_string_lit(void) {
+  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+}
+
+mpc_parser_t *mpc_regex_lit(void) {  
+  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+}
+
+mpc_parser_t *mpc_ident(void) {
+  mpc_parser_t *p0, *p1; 
+  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
+  p1 = mpc_many(mpcf_strfold, mpc_alphanum()); 
+  return mpc_and(2, mpcf_strfold, p0, p1, free);
+}
+
+/*
+** Useful Parsers
+*/
+
+mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
+mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+
+mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
+mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+
+mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+
+mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+  return mpc_and(3, mpcf_snd_free,
+    mpc_string(o), a, mpc_string(c),
+    free, ad);
+}
+
+mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+
+mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+  return mpc_and(3, mpcf_snd_free,
+    mpc_sym(o), mpc_tok(a), mpc_sym(c),
+    free, ad);
+}
+
+mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+
+/*
+** Regular Expression Parsers
+*/
+
+/*
+** So here is a cute bootstrapping.
+**
+** I'm using the previously defined
+** mpc constructs and functions to
+** parse the user regex string and
+** construct a parser from it.
+**
+** As it turns out lots of the standard
+** mpc functions look a lot like `fold`
+** functions and so can be used indirectly
+** by many of the parsing functions to build
+** a parser directly - as we are parsing.
+**
+** This is certainly something that
+** would be less elegant/interesting 
+** in a two-phase parser which first
+** builds an AST and then traverses it
+** to generate the object.
+**
+** This whole thing acts as a great
+** case study for how trivial it can be
+** to write a great parser in a few
+** lines of code using mpc.
+*/
+
+/*
+**
+**  ### Regular Expression Grammar
+**
+**      <regex> : <term> | (<term> "|" <regex>)
+**     
+**      <term> : <factor>*
+**
+**      <factor> : <base>
+**               | <base> "*"
+**               | <base> "+"
+**               | <base> "?"
+**               | <base> "{" <digits> "}"
+**           
+**      <base> : <char>
+**             | "\" <char>
+**             | "(" <regex> ")"
+**             | "[" <range> "]"
+*/
+
+static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  else { return mpc_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
+  int i;
+  mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
+  for (i = 0; i < n; i++) {
+    p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+  }
+  return p;
+}
+
+static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
+  int num;
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }
+  if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }
+  if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }
+  num = *(int*)xs[1];
+  free(xs[1]);
+  
+  return mpc_count(num, mpcf_strfold, xs[0], free);
+}
+
+static mpc_parser_t *mpc_re_escape_char(char c) {
+  switch (c) {
+    case 'a': return mpc_char('\a');
+    case 'f': return mpc_char('\f');
+    case 'n': return mpc_char('\n');
+    case 'r': return mpc_char('\r');
+    case 't': return mpc_char('\t');
+    case 'v': return mpc_char('\v');
+    case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
+    case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
+    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
+    case 'd': return mpc_digit();
+    case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
+    case 's': return mpc_whitespace();
+    case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
+    case 'w': return mpc_alphanum();
+    case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_escape(mpc_val_t *x) {
+  
+  char *s = x;
+  mpc_parser_t *p;
+  
+  /* Regex Special Characters */
+  if (s[0] == '.') { free(s); return mpc_any(); }
+  if (s[0] == '^') { free(s); return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free); }
+  if (s[0] == '$') { free(s); return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free); }
+  
+  /* Regex Escape */
+  if (s[0] == '\\') {
+    p = mpc_re_escape_char(s[1]);
+    p = (p == NULL) ? mpc_char(s[1]) : p;
+    free(s);
+    return p;
+  }
+  
+  /* Regex Standard */
+  p = mpc_char(s[0]);
+  free(s);
+  return p;
+}
+
+static const char *mpc_re_range_escape_char(char c) {
+  switch (c) {
+    case '-': return "-";
+    case 'a': return "\a";
+    case 'f': return "\f";
+    case 'n': return "\n";
+    case 'r': return "\r";
+    case 't': return "\t";
+    case 'v': return "\v";
+    case 'b': return "\b";
+    case 'd': return "0123456789";
+    case 's': return " \f\n\r\t\v";
+    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+  
+  mpc_parser_t *out;
+  size_t i, j;
+  size_t start, end;
+  const char *tmp = NULL;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  char *range = calloc(1,1);
+  
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '^' && 
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  
+  for (i = comp; i < strlen(s); i++){
+    
+    /* Regex Range Escape */
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        range = realloc(range, strlen(range) + strlen(tmp) + 1);
+        strcat(range, tmp);
+      } else {
+        range = realloc(range, strlen(range) + 1 + 1);
+        range[strlen(range) + 1] = '\0';
+        range[strlen(range) + 0] = s[i+1];      
+      }
+      i++;
+    }
+    
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+          range = realloc(range, strlen(range) + strlen("-") + 1);
+          strcat(range, "-");
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          range = realloc(range, strlen(range) + 1 + 1 + 1);
+          range[strlen(range) + 1] = '\0';
+          range[strlen(range) + 0] = j;
+        }        
+      }
+    }
+    
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+  
+  }
   
-  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p1 = mpc_digits();
-  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
-  p30 = mpc_oneof("eE");
-  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p32 = mpc_digits();
-  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
   
-  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
-
+  free(x);
+  free(range);
+  
+  return out;
 }
 
-mpc_parser_t *mpc_float(void) {
-  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
-}
+/*
+** Regex DFAs
+**
+** mpc regexes match the way any other parsers
+** do - repetition is greedy and never gives
+** anything back, and `|` takes the first
+** alternative that matches - while a DFA finds
+** the longest match. The two agree whenever
+** every choice can be made from the next
+** character alone: the alternatives of each
+** `|` start differently, and whatever `*`, `+`
+** or `?` repeat can never start whatever comes
+** after it. Those regexes are compiled to an
+** NFA, then to a DFA by subset construction,
+** which is then minimised. Anything else,
+** including anchors, stays as combinators.
+*/
 
-mpc_parser_t *mpc_char_lit(void) {
-  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
-}
+enum {
+  MPC_DFA_NFA_MAX    = 4096,
+  MPC_DFA_STATES_MAX = 256
+};
 
-mpc_parser_t *mpc_string_lit(void) {
-  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+/* Adds the characters of `p` to `s` if it always matches just one of them */
+static int mpc_dfa_class(mpc_parser_t *p, unsigned char *s) {
+  
+  unsigned char t[32];
+  char x;
+  int c, j;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_ANY:
+      memset(s, 0xFF, 32);
+      return 1;
+    
+    case MPC_TYPE_SINGLE:
+      mpc_dfa_set_add(s, (unsigned char)p->data.single.x);
+      return 1;
+    
+    case MPC_TYPE_RANGE:
+      for (c = 0; c < 256; c++) {
+        x = (char)c;
+        if (x >= p->data.range.x && x <= p->data.range.y) { mpc_dfa_set_add(s, c); }
+      }
+      return 1;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (c = 0; c < 256; c++) {
+        if ((mpc_dfa_set_has(p->data.oneof.s, c) != 0) == (p->type == MPC_TYPE_ONEOF)) {
+          mpc_dfa_set_add(s, c);
+        }
+      }
+      return 1;
+    
+    case MPC_TYPE_EXPECT:
+      return mpc_dfa_class(p->data.expect.x, s);
+    
+    case MPC_TYPE_OR:
+      memset(t, 0, 32);
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_dfa_class(p->data.or.xs[j], t)) { return 0; }
+      }
+      mpc_dfa_set_union(s, t);
+      return 1;
+    
+    default: return 0;
+  }
+  
 }
 
-mpc_parser_t *mpc_regex_lit(void) {  
-  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+/* Adds the possible first characters of `p` to `s` and returns if it can match nothing, or -1 */
+static int mpc_dfa_first(mpc_parser_t *p, unsigned char *s) {
+  
+  int j, k, n = 0;
+  
+  if (mpc_dfa_class(p, s)) { return 0; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+      return 1;
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { return 1; }
+      mpc_dfa_set_add(s, (unsigned char)p->data.string.x[0]);
+      return 0;
+    
+    case MPC_TYPE_EXPECT: return mpc_dfa_first(p->data.expect.x, s);
+    case MPC_TYPE_SPAN:   return mpc_dfa_first(p->data.span.x, s);
+    
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        k = mpc_dfa_first(p->data.and.xs[j], s);
+        if (k <= 0) { return k; }
+      }
+      return 1;
+    
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        k = mpc_dfa_first(p->data.or.xs[j], s);
+        if (k < 0) { return k; }
+        n = n || k;
+      }
+      return n;
+    
+    case MPC_TYPE_MAYBE:
+      return mpc_dfa_first(p->data.not.x, s) < 0 ? -1 : 1;
+    
+    case MPC_TYPE_MANY:
+      return mpc_dfa_first(p->data.repeat.x, s) < 0 ? -1 : 1;
+    
+    case MPC_TYPE_MANY1:
+      return mpc_dfa_first(p->data.repeat.x, s);
+    
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n < 1) { return -1; }
+      return mpc_dfa_first(p->data.repeat.x, s);
+    
+    default: return -1;
+  }
+  
 }
 
-mpc_parser_t *mpc_ident(void) {
-  mpc_parser_t *p0, *p1; 
-  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
-  p1 = mpc_many(mpcf_strfold, mpc_alphanum()); 
-  return mpc_and(2, mpcf_strfold, p0, p1, free);
+/* Checks that `p`, followed by something starting with `follow`, never needs to backtrack */
+static int mpc_dfa_check(mpc_parser_t *p, const unsigned char *follow) {
+  
+  unsigned char s[32], t[32], u[32];
+  int j, k;
+  
+  memset(s, 0, 32);
+  k = mpc_dfa_first(p, s);
+  if (k < 0) { return 0; }
+  if (k && mpc_dfa_set_meets(s, follow)) { return 0; }
+  
+  memset(t, 0, 32);
+  if (mpc_dfa_class(p, t)) { return 1; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STRING:
+      return 1;
+    
+    case MPC_TYPE_EXPECT: return mpc_dfa_check(p->data.expect.x, follow);
+    case MPC_TYPE_SPAN:   return mpc_dfa_check(p->data.span.x, follow);
+    
+    case MPC_TYPE_AND:
+      memcpy(t, follow, 32);
+      for (j = p->data.and.n-1; j >= 0; j--) {
+        if (!mpc_dfa_check(p->data.and.xs[j], t)) { return 0; }
+        memset(u, 0, 32);
+        if (!mpc_dfa_first(p->data.and.xs[j], u)) { memset(t, 0, 32); }
+        mpc_dfa_set_union(t, u);
+      }
+      return 1;
+    
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        memset(u, 0, 32);
+        k = mpc_dfa_first(p->data.or.xs[j], u);
+        if (k && j != p->data.or.n-1) { return 0; }
+        if (mpc_dfa_set_meets(t, u)) { return 0; }
+        if (!mpc_dfa_check(p->data.or.xs[j], follow)) { return 0; }
+        mpc_dfa_set_union(t, u);
+      }
+      return 1;
+    
+    case MPC_TYPE_MAYBE:
+      if (mpc_dfa_first(p->data.not.x, t)) { return 0; }
+      return mpc_dfa_check(p->data.not.x, follow);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (mpc_dfa_first(p->data.repeat.x, t)) { return 0; }
+      if (p->type != MPC_TYPE_COUNT && mpc_dfa_set_meets(t, follow)) { return 0; }
+      mpc_dfa_set_union(t, follow);
+      return mpc_dfa_check(p->data.repeat.x, t);
+    
+    default: return 0;
+  }
+  
 }
 
 /*
-** Useful Parsers
+** A state that reads a character is labelled
+** with what the `expect` around it would have
+** reported had it failed, wrapped by any
+** `many1` or `count` it is the first part of,
+** and `top` says if that failure would then be
+** the one the whole regex fails with. Between
+** those stands anything that always succeeds,
+** or an `or`, which fails with no error.
 */
 
-mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
-mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
-
-mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
-mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
-
-mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+typedef struct {
+  unsigned char set[32];
+  int eps;
+  int out;
+  int alt;
+  char *label;
+  int top;
+} mpc_nfa_state_t;
 
-mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-  return mpc_and(3, mpcf_snd_free,
-    mpc_string(o), a, mpc_string(c),
-    free, ad);
+typedef struct {
+  int num;
+  mpc_nfa_state_t *states;
+} mpc_nfa_t;
+
+static int mpc_nfa_state(mpc_nfa_t *n, int eps, int out, int alt) {
+  mpc_nfa_state_t *s;
+  if (out < 0 && eps != 2) { return -1; }
+  if (n->num == MPC_DFA_NFA_MAX) { return -1; }
+  s = &n->states[n->num];
+  memset(s->set, 0, 32);
+  s->eps = eps != 0;
+  s->out = out;
+  s->alt = alt;
+  s->label = NULL;
+  s->top = 0;
+  return n->num++;
+}
+
+static char *mpc_nfa_prefix(const char *prefix, const char *x) {
+  char *y = malloc(strlen(prefix) + strlen(x) + 1);
+  strcpy(y, prefix);
+  strcat(y, x);
+  return y;
 }
 
-mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+static int mpc_nfa_build(mpc_nfa_t *n, mpc_parser_t *p, int next, const char *prefix, int top);
 
-mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-  return mpc_and(3, mpcf_snd_free,
-    mpc_sym(o), mpc_tok(a), mpc_sym(c),
-    free, ad);
+static int mpc_nfa_build_repeat(mpc_nfa_t *n, mpc_parser_t *p, int next, const char *prefix, int top) {
+  
+  char count[32];
+  char *wrapped;
+  int k;
+  
+  if (p->type == MPC_TYPE_COUNT) {
+    sprintf(count, "%i of ", p->data.repeat.n);
+  } else {
+    strcpy(count, "one or more of ");
+  }
+  
+  wrapped = mpc_nfa_prefix(prefix, count);
+  k = mpc_nfa_build(n, p->data.repeat.x, next, wrapped, top);
+  free(wrapped);
+  return k;
 }
 
-mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
-
-/*
-** Regular Expression Parsers
-*/
-
-/*
-** So here is a cute bootstrapping.
-**
-** I'm using the previously defined
-** mpc constructs and functions to
-** parse the user regex string and
-** construct a parser from it.
-**
-** As it turns out lots of the standard
-** mpc functions look a lot like `fold`
-** functions and so can be used indirectly
-** by many of the parsing functions to build
-** a parser directly - as we are parsing.
-**
-** This is certainly something that
-** would be less elegant/interesting 
-** in a two-phase parser which first
-** builds an AST and then traverses it
-** to generate the object.
-**
-** This whole thing acts as a great
-** case study for how trivial it can be
-** to write a great parser in a few
-** lines of code using mpc.
-*/
-
 /*
-**
-**  ### Regular Expression Grammar
-**
-**      <regex> : <term> | (<term> "|" <regex>)
-**     
-**      <term> : <factor>*
-**
-**      <factor> : <base>
-**               | <base> "*"
-**               | <base> "+"
-**               | <base> "?"
-**               | <base> "{" <digits> "}"
-**           
-**      <base> : <char>
-**             | "\" <char>
-**             | "(" <regex> ")"
-**             | "[" <range> "]"
+** Builds states matching `p` and then going on
+** to `next` - back to front, so that states
+** which would be tried first come last.
 */
-
-static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  else { return mpc_or(2, xs[0], xs[1]); }
+static int mpc_nfa_build(mpc_nfa_t *n, mpc_parser_t *p, int next, const char *prefix, int top) {
+  
+  unsigned char s[32];
+  int j, k, t;
+  
+  if (next < 0) { return -1; }
+  
+  memset(s, 0, 32);
+  if (p->type != MPC_TYPE_OR && mpc_dfa_class(p, s)) {
+    k = mpc_nfa_state(n, 0, next, -1);
+    if (k < 0) { return -1; }
+    memcpy(n->states[k].set, s, 32);
+    if (p->type == MPC_TYPE_EXPECT) {
+      n->states[k].label = mpc_nfa_prefix(prefix, p->data.expect.m);
+    }
+    n->states[k].top = top;
+    return k;
+  }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+      return next;
+    
+    /* An `expect` of more than a character reports where it started */
+    case MPC_TYPE_EXPECT: return -1;
+    case MPC_TYPE_SPAN:   return mpc_nfa_build(n, p->data.span.x, next, prefix, top);
+    
+    case MPC_TYPE_STRING:
+      for (j = (int)strlen(p->data.string.x)-1; j >= 0 && next >= 0; j--) {
+        next = mpc_nfa_state(n, 0, next, -1);
+        if (next >= 0) {
+          mpc_dfa_set_add(n->states[next].set, (unsigned char)p->data.string.x[j]);
+          n->states[next].top = top;
+        }
+      }
+      return next;
+    
+    case MPC_TYPE_AND:
+      for (j = p->data.and.n-1; j >= 0; j--) {
+        next = mpc_nfa_build(n, p->data.and.xs[j], next, prefix, top);
+      }
+      return next;
+    
+    case MPC_TYPE_OR:
+      k = mpc_nfa_build(n, p->data.or.xs[p->data.or.n-1], next, "", 0);
+      for (j = p->data.or.n-2; j >= 0 && k >= 0; j--) {
+        t = mpc_nfa_build(n, p->data.or.xs[j], next, "", 0);
+        k = t < 0 ? -1 : mpc_nfa_state(n, 1, t, k);
+      }
+      return k;
+    
+    case MPC_TYPE_MAYBE:
+      t = mpc_nfa_build(n, p->data.not.x, next, "", 0);
+      return t < 0 ? -1 : mpc_nfa_state(n, 1, t, next);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      k = mpc_nfa_state(n, 2, -1, next);
+      t = k < 0 ? -1 : mpc_nfa_build(n, p->data.repeat.x, k, "", 0);
+      if (t < 0) { return -1; }
+      n->states[k].out = t;
+      if (p->type == MPC_TYPE_MANY) { return k; }
+      return mpc_nfa_build_repeat(n, p, k, prefix, top);
+    
+    /* A `count` which fails part way leaves the input where it failed */
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n > 1) { return -1; }
+      for (j = 0; j < p->data.repeat.n; j++) {
+        next = mpc_nfa_build_repeat(n, p, next, prefix, top);
+      }
+      return next;
+    
+    default: return -1;
+  }
+  
 }
 
-static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
-  int i;
-  mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
-  for (i = 0; i < n; i++) {
-    p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+static void mpc_nfa_closure(mpc_nfa_t *n, char *set, int *stack) {
+  
+  int j, k = 0, q;
+  
+  for (q = 0; q < n->num; q++) { if (set[q]) { stack[k++] = q; } }
+  
+  while (k > 0) {
+    q = stack[--k];
+    if (!n->states[q].eps) { continue; }
+    j = n->states[q].out;
+    if (j >= 0 && !set[j]) { set[j] = 1; stack[k++] = j; }
+    j = n->states[q].alt;
+    if (j >= 0 && !set[j]) { set[j] = 1; stack[k++] = j; }
   }
-  return p;
+  
 }
 
-static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
-  int num;
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }
-  if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }
-  if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }
-  num = *(int*)xs[1];
-  free(xs[1]);
+/*
+** The labels of the states in `set` which read
+** a character, in the order they would be
+** tried, go in `labels` and their number is
+** returned. `top` is set if the last of them
+** is what the regex fails with.
+*/
+static int mpc_nfa_labels(const mpc_nfa_t *n, const char *set, char **labels, int *top) {
   
-  return mpc_count(num, mpcf_strfold, xs[0], free);
+  int j, m = 0, last = -1;
+  
+  for (j = n->num-1; j >= 0; j--) {
+    if (!set[j] || n->states[j].eps) { continue; }
+    last = j;
+    if (n->states[j].label) { labels[m++] = n->states[j].label; }
+  }
+  
+  *top = last >= 0 && n->states[last].label && n->states[last].top;
+  return m;
 }
 
-static mpc_parser_t *mpc_re_escape_char(char c) {
-  switch (c) {
-    case 'a': return mpc_char('\a');
-    case 'f': return mpc_char('\f');
-    case 'n': return mpc_char('\n');
-    case 'r': return mpc_char('\r');
-    case 't': return mpc_char('\t');
-    case 'v': return mpc_char('\v');
-    case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
-    case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
-    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
-    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
-    case 'd': return mpc_digit();
-    case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
-    case 's': return mpc_whitespace();
-    case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
-    case 'w': return mpc_alphanum();
-    case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
-    default: return NULL;
+/* Whether DFA states `s` and `t`, sets of NFA states, report the same failures */
+static int mpc_nfa_labels_equal(const mpc_nfa_t *n, const char *s, const char *t, char **ls, char **lt) {
+  
+  int j, m, top_s, top_t;
+  
+  m = mpc_nfa_labels(n, s, ls, &top_s);
+  if (mpc_nfa_labels(n, t, lt, &top_t) != m || top_s != top_t) { return 0; }
+  for (j = 0; j < m; j++) {
+    if (strcmp(ls[j], lt[j]) != 0) { return 0; }
   }
+  return 1;
 }
 
-static mpc_val_t *mpcf_re_escape(mpc_val_t *x) {
+/*
+** Merges equivalent states, returning the minimal
+** DFA with the dead state removed. The states
+** start out in the classes `part` gives them,
+** and on return it gives the state of the DFA
+** each became, or -1 for the dead state.
+*/
+static mpc_dfa_t *mpc_dfa_minimise(int num, const int *trans, const char *accept, int *part) {
   
-  char *s = x;
-  mpc_parser_t *p;
+  int *cur = malloc(sizeof(int) * num);
+  int *next = malloc(sizeof(int) * num);
+  int *reps = malloc(sizeof(int) * num);
+  int *tmp;
+  int classes = 0, m, s, r, c, k;
+  mpc_dfa_t *d;
   
-  /* Regex Special Characters */
-  if (s[0] == '.') { free(s); return mpc_any(); }
-  if (s[0] == '^') { free(s); return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free); }
-  if (s[0] == '$') { free(s); return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free); }
+  for (s = 0; s < num; s++) { cur[s] = part[s]; }
   
-  /* Regex Escape */
-  if (s[0] == '\\') {
-    p = mpc_re_escape_char(s[1]);
-    p = (p == NULL) ? mpc_char(s[1]) : p;
-    free(s);
-    return p;
+  while (1) {
+    
+    m = 0;
+    for (s = 0; s < num; s++) {
+      for (k = 0; k < m; k++) {
+        r = reps[k];
+        if (cur[r] != cur[s]) { continue; }
+        for (c = 0; c < 256; c++) {
+          if (cur[trans[r*256+c]] != cur[trans[s*256+c]]) { break; }
+        }
+        if (c == 256) { break; }
+      }
+      if (k == m) { reps[m++] = s; }
+      next[s] = k;
+    }
+    
+    tmp = cur; cur = next; next = tmp;
+    if (m == classes) { break; }
+    classes = m;
   }
   
-  /* Regex Standard */
-  p = mpc_char(s[0]);
-  free(s);
-  return p;
+  /* State zero is the empty set so class zero is dead */
+  
+  d = NULL;
+  if (cur[1] != 0) {
+    d = malloc(sizeof(mpc_dfa_t));
+    d->num = m - 1;
+    d->start = cur[1] - 1;
+    d->trans = malloc(sizeof(int) * 256 * d->num);
+    d->accept = malloc(d->num);
+    for (k = 1; k < m; k++) {
+      r = reps[k];
+      d->accept[k-1] = accept[r];
+      for (c = 0; c < 256; c++) {
+        d->trans[(k-1)*256+c] = cur[trans[r*256+c]] - 1;
+      }
+    }
+  }
+  
+  for (s = 0; s < num; s++) { part[s] = cur[s] - 1; }
+  
+  free(cur);
+  free(next);
+  free(reps);
+  return d;
 }
 
-static const char *mpc_re_range_escape_char(char c) {
-  switch (c) {
-    case '-': return "-";
-    case 'a': return "\a";
-    case 'f': return "\f";
-    case 'n': return "\n";
-    case 'r': return "\r";
-    case 't': return "\t";
-    case 'v': return "\v";
-    case 'b': return "\b";
-    case 'd': return "0123456789";
-    case 's': return " \f\n\r\t\v";
-    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
-    default: return NULL;
+/* Gives each state of `d` the failures of the NFA states it was made from */
+static void mpc_dfa_expected(mpc_dfa_t *d, const mpc_nfa_t *n, int num, const char *sets, const int *part) {
+  
+  char **labels = malloc(sizeof(char*) * n->num);
+  int *from = malloc(sizeof(int) * d->num);
+  int j, k, m, s, top;
+  
+  for (s = 0; s < num; s++) {
+    if (part[s] >= 0) { from[part[s]] = s; }
+  }
+  
+  d->at = malloc(sizeof(int) * (d->num + 1));
+  d->expected = NULL;
+  d->returns = malloc(d->num);
+  d->at[0] = 0;
+  
+  for (k = 0; k < d->num; k++) {
+    m = mpc_nfa_labels(n, sets + from[k] * n->num, labels, &top);
+    d->at[k+1] = d->at[k] + m;
+    d->expected = realloc(d->expected, sizeof(char*) * (d->at[k+1] > 0 ? d->at[k+1] : 1));
+    for (j = 0; j < m; j++) {
+      d->expected[d->at[k] + j] = malloc(strlen(labels[j]) + 1);
+      strcpy(d->expected[d->at[k] + j], labels[j]);
+    }
+    d->returns[k] = (char)top;
   }
+  
+  free(labels);
+  free(from);
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+static mpc_dfa_t *mpc_dfa_compile(mpc_parser_t *p) {
   
-  mpc_parser_t *out;
-  size_t i, j;
-  size_t start, end;
-  const char *tmp = NULL;
-  const char *s = x;
-  int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
+  unsigned char none[32];
+  mpc_nfa_t n;
+  mpc_nfa_state_t *q;
+  mpc_dfa_t *d = NULL;
+  char *sets, *set, *accept;
+  char **ls, **lt;
+  int *trans, *stack, *part;
+  int num, start, s, t, c, j;
   
-  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
-  if (s[0] == '^' && 
-      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  memset(none, 0, 32);
+  if (!mpc_dfa_check(p, none)) { return NULL; }
   
-  for (i = comp; i < strlen(s); i++){
+  /* State zero of the NFA is the accepting state */
+  
+  n.num = 0;
+  n.states = malloc(sizeof(mpc_nfa_state_t) * MPC_DFA_NFA_MAX);
+  mpc_nfa_state(&n, 2, -1, -1);
+  start = mpc_nfa_build(&n, p, 0, "", 1);
+  
+  if (start < 0) {
+    for (j = 0; j < n.num; j++) { free(n.states[j].label); }
+    free(n.states);
+    return NULL;
+  }
+  
+  sets = calloc(MPC_DFA_STATES_MAX + 1, n.num);
+  trans = malloc(sizeof(int) * 256 * MPC_DFA_STATES_MAX);
+  accept = malloc(MPC_DFA_STATES_MAX);
+  stack = malloc(sizeof(int) * n.num);
+  
+  /* State zero of the DFA is the empty set */
+  
+  sets[n.num + start] = 1;
+  mpc_nfa_closure(&n, sets + n.num, stack);
+  num = 2;
+  
+  for (s = 0; s < num && num <= MPC_DFA_STATES_MAX; s++) {
     
-    /* Regex Range Escape */
-    if (s[i] == '\\') {
-      tmp = mpc_re_range_escape_char(s[i+1]);
-      if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
-      } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];      
+    accept[s] = sets[s * n.num];
+    
+    for (c = 0; c < 256; c++) {
+      
+      set = sets + num * n.num;
+      memset(set, 0, n.num);
+      for (j = 0; j < n.num; j++) {
+        q = &n.states[j];
+        if (sets[s * n.num + j] && !q->eps && mpc_dfa_set_has(q->set, c)) {
+          set[q->out] = 1;
+        }
       }
-      i++;
+      mpc_nfa_closure(&n, set, stack);
+      
+      if (c > 0 && memcmp(set, sets + trans[s*256+c-1] * n.num, n.num) == 0) {
+        trans[s*256+c] = trans[s*256+c-1];
+        continue;
+      }
+      
+      for (t = 0; t < num; t++) {
+        if (memcmp(set, sets + t * n.num, n.num) == 0) { break; }
+      }
+      if (t == num) { num++; }
+      if (num > MPC_DFA_STATES_MAX) { break; }
+      trans[s*256+c] = t;
     }
+  }
+  
+  if (num <= MPC_DFA_STATES_MAX) {
     
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = j;
-        }        
+    /* States which report different failures are never merged */
+    
+    part = malloc(sizeof(int) * num);
+    ls = malloc(sizeof(char*) * n.num);
+    lt = malloc(sizeof(char*) * n.num);
+    for (s = 0; s < num; s++) {
+      for (t = 0; t < s; t++) {
+        if (part[t] == t && accept[t] == accept[s]
+        && mpc_nfa_labels_equal(&n, sets + t * n.num, sets + s * n.num, ls, lt)) { break; }
       }
+      part[s] = t;
     }
+    free(ls);
+    free(lt);
     
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
-    }
-  
+    d = mpc_dfa_minimise(num, trans, accept, part);
+    if (d) { mpc_dfa_expected(d, &n, num, sets, part); }
+    free(part);
   }
   
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
-  
-  free(x);
-  free(range);
-  
-  return out;
+  for (j = 0; j < n.num; j++) { free(n.states[j].label); }
+  free(n.states);
+  free(sets);
+  free(trans);
+  free(accept);
+  free(stack);
+  return d;
+}
+
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *a, mpc_dfa_t *d) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.x = a;
+  p->data.dfa.d = d;
+  return p;
 }
 
 mpc_parser_t *mpc_re(const char *re) {
@@ -2047,6 +3668,7 @@ mpc_parser_t *mpc_re(const char *re) {
   char *err_msg;
   mpc_parser_t *err_out;
   mpc_result_t r;
+  mpc_dfa_t *d;
   mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
   
   Regex  = mpc_new("regex");
@@ -2105,7 +3727,9 @@ mpc_parser_t *mpc_re(const char *re) {
   
   mpc_optimise(r.output);
   
-  return r.output;
+  /* What a regex returns is always just the input it matched */
+  d = mpc_dfa_compile(r.output);
+  return d ? mpc_re_dfa(r.output, d) : mpc_span(r.output);
   
 }
 
@@ -2328,18 +3952,23 @@ mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2)
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
   int i;
-  size_t l = 0;
+  size_t l = 0, m;
   
   if (n == 0) { return calloc(1, 1); }
   
   for (i = 0; i < n; i++) { l += strlen(xs[i]); }
   
+  m = strlen(xs[0]);
   xs[0] = realloc(xs[0], l + 1);
   
   for (i = 1; i < n; i++) {
-    strcat(xs[0], xs[i]); free(xs[i]);
+    l = strlen(xs[i]);
+    memcpy((char*)xs[0] + m, xs[i], l);
+    m += l;
+    free(xs[i]);
   }
   
+  ((char*)xs[0])[m] = '\0';
   return xs[0];
 }
 
@@ -2418,7 +4047,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   
   if (p->type == MPC_TYPE_ONEOF) {
     s = mpcf_escape_new(
-      p->data.string.x,
+      p->data.oneof.x,
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("[%s]", s);
@@ -2427,7 +4056,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   
   if (p->type == MPC_TYPE_NONEOF) {
     s = mpcf_escape_new(
-      p->data.string.x,
+      p->data.oneof.x,
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("[^%s]", s);
@@ -2446,6 +4075,9 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)     { mpc_print_unretained(p->data.span.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)  { mpc_print_unretained(p->data.packrat.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2496,56 +4128,247 @@ void mpc_print(mpc_parser_t *p) {
 **
 */
 
-int mpc_test_fail(mpc_parser_t *p, const char *s, const void *d,
-  int(*tester)(const void*, const void*),
-  mpc_dtor_t destructor,
-  void(*printer)(const void*)) {
-  mpc_result_t r;
-  (void) printer;
-  if (mpc_parse("<test>", s, p, &r)) {
+int mpc_test_fail(mpc_parser_t *p, const char *s, const void *d,
+  int(*tester)(const void*, const void*),
+  mpc_dtor_t destructor,
+  void(*printer)(const void*)) {
+  mpc_result_t r;
+  (void) printer;
+  if (mpc_parse("<test>", s, p, &r)) {
+
+    if (tester(r.output, d)) {
+      destructor(r.output);
+      return 0;
+    } else {
+      destructor(r.output);
+      return 1;
+    }
+  
+  } else {
+    mpc_err_delete(r.error);
+    return 1;
+  }
+  
+}
+
+int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
+  int(*tester)(const void*, const void*), 
+  mpc_dtor_t destructor, 
+  void(*printer)(const void*)) {
+
+  mpc_result_t r;  
+  if (mpc_parse("<test>", s, p, &r)) {
+    
+    if (tester(r.output, d)) {
+      destructor(r.output);
+      return 1;
+    } else {
+      printf("Got "); printer(r.output); printf("\n");
+      printf("Expected "); printer(d); printf("\n");
+      destructor(r.output);
+      return 0;
+    }
+    
+  } else {    
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 0;
+    
+  }
+  
+}
+
+
+/*
+** AST
+*/
+
+/*
+** AST Arenas
+**
+** While an arena is in use on a thread, the ASTs made on that
+** thread are allocated from it in large chunks, rather than with a
+** malloc for every node, tag, contents and list of children, and are
+** all freed at once when it is reset. Tags are interned in the arena
+** (and outlive resets), so setting or extending the tag of a node is
+** normally a lookup in a small cache.
+*/
+
+#if defined(_MSC_VER)
+#define MPC_THREAD_LOCAL __declspec(thread)
+#else
+#define MPC_THREAD_LOCAL __thread
+#endif
+
+#define MPC_AST_ARENA_CHUNK 65536
+#define MPC_AST_ARENA_ALIGN 16
+#define MPC_AST_ARENA_CACHE 256
+
+typedef struct mpc_ast_chunk_t {
+  struct mpc_ast_chunk_t *next;
+  size_t size;
+  size_t used;
+} mpc_ast_chunk_t;
+
+typedef struct {
+  const char *prefix;
+  const char *tag;
+  char *result;
+} mpc_ast_tag_cache_t;
+
+struct mpc_ast_arena_t {
+  mpc_ast_chunk_t *chunks;
+  char **tags;
+  int tags_num;
+  int tags_max;
+  mpc_ast_tag_cache_t cache[MPC_AST_ARENA_CACHE];
+};
+
+static MPC_THREAD_LOCAL mpc_ast_arena_t *mpc_ast_arena_current = NULL;
+
+/* The header of a chunk is padded so that what follows it is aligned */
+static size_t mpc_ast_chunk_header(void) {
+  return (sizeof(mpc_ast_chunk_t) + MPC_AST_ARENA_ALIGN - 1) & ~(size_t)(MPC_AST_ARENA_ALIGN - 1);
+}
+
+static mpc_ast_chunk_t *mpc_ast_chunk_new(size_t size, mpc_ast_chunk_t *next) {
+  mpc_ast_chunk_t *c = malloc(mpc_ast_chunk_header() + size);
+  c->next = next;
+  c->size = size;
+  c->used = 0;
+  return c;
+}
+
+mpc_ast_arena_t *mpc_ast_arena_new(void) {
+  mpc_ast_arena_t *a = calloc(1, sizeof(mpc_ast_arena_t));
+  a->chunks = mpc_ast_chunk_new(MPC_AST_ARENA_CHUNK, NULL);
+  return a;
+}
+
+void mpc_ast_arena_reset(mpc_ast_arena_t *a) {
+  
+  mpc_ast_chunk_t *c, *next;
+  
+  /* Keep the most recent chunk to build the next AST in */
+  for (c = a->chunks->next; c; c = next) {
+    next = c->next;
+    free(c);
+  }
+  a->chunks->next = NULL;
+  a->chunks->used = 0;
+}
+
+void mpc_ast_arena_delete(mpc_ast_arena_t *a) {
+  
+  int i;
+  
+  if (a == NULL) { return; }
+  if (mpc_ast_arena_current == a) { mpc_ast_arena_current = NULL; }
+  
+  mpc_ast_arena_reset(a);
+  free(a->chunks);
+  for (i = 0; i < a->tags_max; i++) { free(a->tags[i]); }
+  free(a->tags);
+  free(a);
+}
+
+mpc_ast_arena_t *mpc_ast_arena_use(mpc_ast_arena_t *a) {
+  mpc_ast_arena_t *previous = mpc_ast_arena_current;
+  mpc_ast_arena_current = a;
+  return previous;
+}
 
-    if (tester(r.output, d)) {
-      destructor(r.output);
-      return 0;
-    } else {
-      destructor(r.output);
-      return 1;
-    }
+static void *mpc_ast_arena_alloc(mpc_ast_arena_t *a, size_t n) {
   
-  } else {
-    mpc_err_delete(r.error);
-    return 1;
+  mpc_ast_chunk_t *c = a->chunks;
+  void *x;
+  
+  n = (n + MPC_AST_ARENA_ALIGN - 1) & ~(size_t)(MPC_AST_ARENA_ALIGN - 1);
+  
+  if (c->used + n > c->size) {
+    if (n > MPC_AST_ARENA_CHUNK / 4) {
+      /* Big allocations get a chunk of their own, behind the current one */
+      c->next = mpc_ast_chunk_new(n, c->next);
+      c->next->used = n;
+      return (char*)c->next + mpc_ast_chunk_header();
+    }
+    c = a->chunks = mpc_ast_chunk_new(MPC_AST_ARENA_CHUNK, c);
   }
   
+  x = (char*)c + mpc_ast_chunk_header() + c->used;
+  c->used += n;
+  return x;
 }
 
-int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
-  int(*tester)(const void*, const void*), 
-  mpc_dtor_t destructor, 
-  void(*printer)(const void*)) {
+static unsigned long mpc_ast_hash_str(const char *s) {
+  unsigned long h = 5381;
+  while (*s) { h = h * 33 + (unsigned char)*s++; }
+  return h;
+}
 
-  mpc_result_t r;  
-  if (mpc_parse("<test>", s, p, &r)) {
-    
-    if (tester(r.output, d)) {
-      destructor(r.output);
-      return 1;
-    } else {
-      printf("Got "); printer(r.output); printf("\n");
-      printf("Expected "); printer(d); printf("\n");
-      destructor(r.output);
-      return 0;
+/* Returns the interned copy of `s` */
+static char *mpc_ast_arena_intern(mpc_ast_arena_t *a, const char *s) {
+  
+  int i, j;
+  char **old;
+  int old_max;
+  
+  if (a->tags_num * 2 >= a->tags_max) {
+    old = a->tags;
+    old_max = a->tags_max;
+    a->tags_max = old_max ? old_max * 2 : 64;
+    a->tags = calloc(a->tags_max, sizeof(char*));
+    for (i = 0; i < old_max; i++) {
+      if (old[i] == NULL) { continue; }
+      j = mpc_ast_hash_str(old[i]) & (a->tags_max - 1);
+      while (a->tags[j]) { j = (j + 1) & (a->tags_max - 1); }
+      a->tags[j] = old[i];
     }
-    
-  } else {    
-    mpc_err_print(r.error);
-    mpc_err_delete(r.error);
-    return 0;
-    
+    free(old);
+  }
+  
+  j = mpc_ast_hash_str(s) & (a->tags_max - 1);
+  while (a->tags[j]) {
+    if (strcmp(a->tags[j], s) == 0) { return a->tags[j]; }
+    j = (j + 1) & (a->tags_max - 1);
   }
   
+  a->tags[j] = malloc(strlen(s) + 1);
+  strcpy(a->tags[j], s);
+  a->tags_num++;
+  return a->tags[j];
 }
 
+/*
+** Returns the interned tag "prefix|tag", or "prefix" when `tag` is NULL.
+** The cache is keyed on the addresses of the two, which are the names of
+** parsers, literals or interned tags, none of which change.
+*/
+static char *mpc_ast_arena_tag(mpc_ast_arena_t *a, const char *prefix, const char *tag) {
+  
+  size_t k = ((size_t)prefix * 31) ^ ((size_t)tag >> 4);
+  mpc_ast_tag_cache_t *e = &a->cache[(k ^ (k >> 11)) & (MPC_AST_ARENA_CACHE - 1)];
+  char buffer[256];
+  char *s = buffer;
+  size_t n;
+  
+  if (e->result && e->prefix == prefix && e->tag == tag) { return e->result; }
+  
+  if (tag == NULL) {
+    e->result = mpc_ast_arena_intern(a, prefix);
+  } else {
+    n = strlen(prefix) + 1 + strlen(tag) + 1;
+    if (n > sizeof(buffer)) { s = malloc(n); }
+    strcpy(s, prefix);
+    strcat(s, "|");
+    strcat(s, tag);
+    e->result = mpc_ast_arena_intern(a, s);
+    if (s != buffer) { free(s); }
+  }
+  e->prefix = prefix;
+  e->tag = tag;
+  return e->result;
+}
 
 /*
 ** AST
@@ -2556,6 +4379,8 @@ void mpc_ast_delete(mpc_ast_t *a) {
   int i;
   
   if (a == NULL) { return; }
+  if (--a->refs > 0) { return; }
+  if (a->arena) { return; }
   
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
@@ -2569,6 +4394,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (a->arena) { return; }
   free(a->children);
   free(a->tag);
   free(a->contents);
@@ -2577,17 +4403,29 @@ static void mpc_ast_delete_no_children(mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
-  
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  mpc_ast_arena_t *arena = mpc_ast_arena_current;
+  mpc_ast_t *a;
+  size_t n = strlen(contents) + 1;
   
-  a->contents = malloc(strlen(contents) + 1);
-  strcpy(a->contents, contents);
+  if (arena) {
+    a = mpc_ast_arena_alloc(arena, sizeof(mpc_ast_t));
+    a->tag = mpc_ast_arena_tag(arena, tag, NULL);
+    a->contents = mpc_ast_arena_alloc(arena, n);
+  } else {
+    a = malloc(sizeof(mpc_ast_t));
+    a->tag = malloc(strlen(tag) + 1);
+    strcpy(a->tag, tag);
+    a->contents = malloc(n);
+  }
+  memcpy(a->contents, contents, n);
   
+  a->arena = arena;
+  a->refs = 1;
+  a->id = MPC_AST_NONE;
   a->state = mpc_state_new();
   
   a->children_num = 0;
+  a->children_max = 0;
   a->children = NULL;
   return a;
   
@@ -2620,6 +4458,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 1) { return a; }
 
   r = mpc_ast_new(">", "");
+  r->id = MPC_AST_ROOT;
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -2639,15 +4478,69 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   return 1;
 }
 
+/* A new node like `a`, without its children */
+static mpc_ast_t *mpc_ast_copy_node(mpc_ast_t *a) {
+  
+  mpc_ast_t *b = mpc_ast_new("", a->contents);
+  
+  if (b->arena) {
+    b->tag = b->arena == a->arena ? a->tag : mpc_ast_arena_intern(b->arena, a->tag);
+  } else {
+    b->tag = realloc(b->tag, strlen(a->tag) + 1);
+    strcpy(b->tag, a->tag);
+  }
+  b->id = a->id;
+  b->state = a->state;
+  return b;
+}
+
+/* Gives up `a` for a node of its own to change, if it is shared */
+static mpc_ast_t *mpc_ast_unshare(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *b;
+  
+  if (a->refs == 1) { return a; }
+  
+  b = mpc_ast_copy_node(a);
+  for (i = 0; i < a->children_num; i++) {
+    mpc_ast_add_child(b, mpc_ast_share(a->children[i]));
+  }
+  
+  a->refs--;
+  return b;
+}
+
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
-  r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
-  r->children[r->children_num-1] = a;
+  
+  mpc_ast_t **children;
+  
+  r = mpc_ast_unshare(r);
+  
+  if (r->children_num == r->children_max) {
+    r->children_max = r->children_max ? r->children_max * 2 : 4;
+    if (r->arena) {
+      children = mpc_ast_arena_alloc(r->arena, sizeof(mpc_ast_t*) * r->children_max);
+      if (r->children_num) {
+        memcpy(children, r->children, sizeof(mpc_ast_t*) * r->children_num);
+      }
+      r->children = children;
+    } else {
+      r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_max);
+    }
+  }
+  
+  r->children[r->children_num++] = a;
   return r;
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  a = mpc_ast_unshare(a);
+  if (a->arena) {
+    a->tag = mpc_ast_arena_tag(a->arena, t, a->tag);
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
@@ -2656,6 +4549,11 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  a = mpc_ast_unshare(a);
+  if (a->arena) {
+    a->tag = mpc_ast_arena_tag(a->arena, t, NULL);
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -2663,10 +4561,31 @@ mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
+  a = mpc_ast_unshare(a);
   a->state = s;
   return a;
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *b;
+  
+  if (a == NULL) { return a; }
+  
+  b = mpc_ast_copy_node(a);
+  for (i = 0; i < a->children_num; i++) {
+    mpc_ast_add_child(b, mpc_ast_copy(a->children[i]));
+  }
+  
+  return b;
+}
+
+mpc_ast_t *mpc_ast_share(mpc_ast_t *a) {
+  if (a) { a->refs++; }
+  return a;
+}
+
 static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
   
   int i;
@@ -2703,7 +4622,7 @@ void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
 
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   
-  int i, j;
+  int i, j, shared;
   mpc_ast_t** as = (mpc_ast_t**)xs;
   mpc_ast_t *r;
   
@@ -2720,11 +4639,14 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     
     if (as[i] && as[i]->children_num > 0) {
       
+      shared = as[i]->refs > 1;
       for (j = 0; j < as[i]->children_num; j++) {
+        if (shared) { mpc_ast_share(as[i]->children[j]); }
         mpc_ast_add_child(r, as[i]->children[j]);
       }
       
-      mpc_ast_delete_no_children(as[i]);
+      if (shared) { mpc_ast_delete(as[i]); }
+      else { mpc_ast_delete_no_children(as[i]); }
       
     } else if (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
@@ -2745,6 +4667,12 @@ mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
   return a;
 }
 
+static mpc_val_t *mpcf_literal_ast(mpc_val_t *c) {
+  mpc_ast_t *a = mpcf_str_ast(c);
+  a->id = MPC_AST_LITERAL;
+  return a;
+}
+
 mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
   mpc_state_t *s = ((mpc_state_t**)xs)[0];
   mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
@@ -2786,6 +4714,7 @@ mpc_parser_t *mpca_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.d = NULL;
   
   va_start(va, n);  
   for (i = 0; i < n; i++) {
@@ -2908,7 +4837,7 @@ static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_literal_ast), "string"));
 }
 
 static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
@@ -2916,7 +4845,7 @@ static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_literal_ast), "char"));
 }
 
 static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
@@ -2983,14 +4912,63 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
   
 }
 
+/*
+** Tags the node made by rule `p` with its name and, unless an inner rule
+** already did, its id. With MPCA_LANG_DROP_LITERALS, the literals among
+** its children are dropped, and a node with any children left is given
+** a root, so that it stays a node of its own when folded into its parent.
+*/
+static mpc_val_t *mpcaf_ast_rule(mpc_val_t *x, void *d) {
+
+  int i, j;
+  mpc_parser_t *p = d;
+  mpc_ast_t *a = mpc_ast_add_tag(x, p->name);
+  mpc_ast_t *r;
+  
+  if (a == NULL) { return a; }
+  if (a->id != MPC_AST_NONE && a->id != MPC_AST_LITERAL) {
+    return mpc_ast_add_root(a);
+  }
+  
+  a->id = p->id;
+  if (!(p->flags & MPCA_LANG_DROP_LITERALS)) { return mpc_ast_add_root(a); }
+  
+  for (i = 0, j = 0; i < a->children_num; i++) {
+    if (a->children[i]->id == MPC_AST_LITERAL) {
+      mpc_ast_delete(a->children[i]);
+    } else {
+      a->children[j++] = a->children[i];
+    }
+  }
+  a->children_num = j;
+  
+  if (a->children_num == 0) { return a; }
+  
+  r = mpc_ast_new(">", "");
+  r->id = MPC_AST_ROOT;
+  mpc_ast_add_child(r, a);
+  return r;
+}
+
 static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   
+  int i;
   mpca_grammar_st_t *st = s;
   mpc_parser_t *p = mpca_grammar_find_parser(x, st);
+  mpc_parser_t *q;
   free(x);
 
   if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+    for (i = 0; i < st->parsers_num; i++) {
+      if (st->parsers[i] == p) { p->id = i + 1; }
+    }
+    p->flags = st->flags;
+    q = mpca_state(mpc_apply_to(p, mpcaf_ast_rule, p));
+    if (st->flags & MPCA_LANG_PACKRAT) {
+      q = mpc_packrat(q, (mpc_apply_t)mpc_ast_share, (mpc_dtor_t)mpc_ast_delete);
+      q->data.packrat.key = p;
+    }
+    return q;
   } else {
     return mpca_state(mpca_root(p));
   }
@@ -3152,6 +5130,8 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   return NULL;
 }
 
+static void mpc_analyse_all(int n, mpc_parser_t **ps);
+
 static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
   
   mpc_result_t r;
@@ -3214,6 +5194,7 @@ static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
     e = r.error;
   } else {
     e = NULL;
+    mpc_analyse_all(st->parsers_num, st->parsers);
   }
   
   mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
@@ -3288,113 +5269,409 @@ mpc_err_t *mpca_lang(int flags, const char *language, ...) {
   return err;
 }
 
-mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
-  
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
-  
-  va_list va;
+mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+  
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+  
+  va_list va;
+
+  FILE *f = fopen(filename, "rb");
+  
+  if (f == NULL) {
+    err = mpc_err_file(filename, "Unable to open file!");
+    return err;
+  }
+  
+  va_start(va, filename);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  
+  i = mpc_input_new_file(filename, f);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+  
+  free(st.parsers);
+  va_end(va);  
+  
+  fclose(f);
+  
+  return err;
+}
+
+static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
+
+  int i, total;
+
+  if (p->retained && !force) { return 0; }
+
+  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
+
+  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)     { return 1 + mpc_nodecount_unretained(p->data.span.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { return 1 + mpc_nodecount_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)  { return 1 + mpc_nodecount_unretained(p->data.packrat.x, 0); }
+
+  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+
+  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+
+  if (p->type == MPC_TYPE_OR) { 
+    total = 0;
+    for(i = 0; i < p->data.or.n; i++) {
+      total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
+    }
+    return total;
+  }
+  
+  if (p->type == MPC_TYPE_AND) {
+    total = 0;
+    for(i = 0; i < p->data.and.n; i++) {
+      total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
+    }
+    return total;
+  }
+
+  return 1;
+  
+}
+
+void mpc_stats(mpc_parser_t* p) {
+  printf("Stats\n");
+  printf("=====\n");
+  printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+}
+
+/*
+** Optimisation
+**
+** Besides flattening nested `or`s and `and`s,
+** `mpc_optimise` rewrites parsers into smaller
+** ones which do just the same, so `mpc_print`
+** shows what is really run. Below an `expect`
+** or a `not` no failure is ever reported, so
+** there any inner `expect` is dropped and any
+** `span` the DFAs can match is compiled to
+** one. Bare characters and strings never
+** report failures of their own, so adjacent
+** ones of a string are merged into one, and
+** alternatives of single characters into one
+** bitmap `oneof`. An `apply_to` takes in the
+** `apply` below it, and alternatives which
+** start with the same parser have it parsed
+** just once before them. That last relies on
+** the `or` rewinding to try each alternative,
+** so isn't done below a `predictive`.
+*/
+
+enum {
+  MPC_OPTIMISE_SUPPRESSED = 1,
+  MPC_OPTIMISE_PREDICTIVE = 2
+};
+
+static int mpc_subparsers(mpc_parser_t *p, mpc_parser_t ***xs);
+static void mpc_optimise_unretained(mpc_parser_t *p, int force, int within);
+
+/* Checks that `p` uses no retained parsers, which could be recursive */
+static int mpc_optimise_closed(mpc_parser_t *p) {
+  mpc_parser_t **xs;
+  int j, n;
+  if (p->retained) { return 0; }
+  n = mpc_subparsers(p, &xs);
+  for (j = 0; j < n; j++) { if (!mpc_optimise_closed(xs[j])) { return 0; } }
+  return 1;
+}
+
+/* Checks if `a` and `b` parse the same, if not then the same parser */
+static int mpc_optimise_equal(mpc_parser_t *a, mpc_parser_t *b) {
+  
+  int j;
+  
+  if (a == b) { return 1; }
+  if (a->retained || b->retained || a->type != b->type) { return 0; }
+  
+  switch (a->type) {
+    
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANY:
+      return 1;
+    
+    case MPC_TYPE_FAIL: return strcmp(a->data.fail.m, b->data.fail.m) == 0;
+    
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+      return a->data.lift.lf == b->data.lift.lf && a->data.lift.x == b->data.lift.x;
+    
+    case MPC_TYPE_EXPECT:
+      return strcmp(a->data.expect.m, b->data.expect.m) == 0
+        && mpc_optimise_equal(a->data.expect.x, b->data.expect.x);
+    
+    case MPC_TYPE_ANCHOR:  return a->data.anchor.f == b->data.anchor.f;
+    case MPC_TYPE_SINGLE:  return a->data.single.x == b->data.single.x;
+    case MPC_TYPE_SATISFY: return a->data.satisfy.f == b->data.satisfy.f;
+    case MPC_TYPE_STRING:  return strcmp(a->data.string.x, b->data.string.x) == 0;
+    
+    case MPC_TYPE_RANGE:
+      return a->data.range.x == b->data.range.x && a->data.range.y == b->data.range.y;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      return memcmp(a->data.oneof.s, b->data.oneof.s, 32) == 0;
+    
+    case MPC_TYPE_APPLY:
+      return a->data.apply.f == b->data.apply.f
+        && mpc_optimise_equal(a->data.apply.x, b->data.apply.x);
+    
+    case MPC_TYPE_APPLY_TO:
+      return a->data.apply_to.f == b->data.apply_to.f
+        && a->data.apply_to.d == b->data.apply_to.d
+        && a->data.apply_to.g == b->data.apply_to.g
+        && mpc_optimise_equal(a->data.apply_to.x, b->data.apply_to.x);
+    
+    case MPC_TYPE_PREDICT: return mpc_optimise_equal(a->data.predict.x, b->data.predict.x);
+    case MPC_TYPE_SPAN:    return mpc_optimise_equal(a->data.span.x, b->data.span.x);
+    case MPC_TYPE_DFA:     return mpc_optimise_equal(a->data.dfa.x, b->data.dfa.x);
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      return a->data.not.dx == b->data.not.dx && a->data.not.lf == b->data.not.lf
+        && mpc_optimise_equal(a->data.not.x, b->data.not.x);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      return a->data.repeat.n == b->data.repeat.n && a->data.repeat.f == b->data.repeat.f
+        && a->data.repeat.dx == b->data.repeat.dx
+        && mpc_optimise_equal(a->data.repeat.x, b->data.repeat.x);
+    
+    case MPC_TYPE_OR:
+      if (a->data.or.n != b->data.or.n) { return 0; }
+      for (j = 0; j < a->data.or.n; j++) {
+        if (!mpc_optimise_equal(a->data.or.xs[j], b->data.or.xs[j])) { return 0; }
+      }
+      return 1;
+    
+    case MPC_TYPE_AND:
+      if (a->data.and.n != b->data.and.n || a->data.and.f != b->data.and.f) { return 0; }
+      for (j = 0; j < a->data.and.n; j++) {
+        if (!mpc_optimise_equal(a->data.and.xs[j], b->data.and.xs[j])) { return 0; }
+        if (j > 0 && a->data.and.dxs[j-1] != b->data.and.dxs[j-1]) { return 0; }
+      }
+      return 1;
+    
+    /* Packrat parsers each have their own results saved */
+    default: return 0;
+  }
+  
+}
+
+/* Adds the characters of `p` to `s` if it is a bare character */
+static int mpc_optimise_class(mpc_parser_t *p, unsigned char *s) {
+  if (p->retained) { return 0; }
+  if (p->type != MPC_TYPE_SINGLE
+  &&  p->type != MPC_TYPE_RANGE
+  &&  p->type != MPC_TYPE_ONEOF) { return 0; }
+  return mpc_dfa_class(p, s);
+}
 
-  FILE *f = fopen(filename, "rb");
-  
-  if (f == NULL) {
-    err = mpc_err_file(filename, "Unable to open file!");
-    return err;
-  }
+/* Merges runs of alternatives which are bare characters into a `oneof` */
+static int mpc_optimise_or_class(mpc_parser_t *p) {
   
-  va_start(va, filename);
-  
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
-  
-  i = mpc_input_new_file(filename, f);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
-  
-  free(st.parsers);
-  va_end(va);  
+  unsigned char s[32];
+  mpc_parser_t *t;
+  int c, j, k, m, n = p->data.or.n;
   
-  fclose(f);
+  for (j = 0; j < n; j++) {
+    
+    memset(s, 0, 32);
+    if (!mpc_optimise_class(p->data.or.xs[j], s)) { continue; }
+    for (k = j + 1; k < n && mpc_optimise_class(p->data.or.xs[k], s); k++);
+    if (k - j < 2) { continue; }
+    
+    t = mpc_undefined();
+    t->type = MPC_TYPE_ONEOF;
+    t->data.oneof.x = malloc(257);
+    memcpy(t->data.oneof.s, s, 32);
+    for (c = 1, m = 0; c < 256; c++) {
+      if (mpc_dfa_set_has(s, c)) { t->data.oneof.x[m++] = (char)c; }
+    }
+    t->data.oneof.x[m] = '\0';
+    t->data.oneof.x = realloc(t->data.oneof.x, m + 1);
+    
+    for (m = j; m < k; m++) { mpc_delete(p->data.or.xs[m]); }
+    p->data.or.xs[j] = t;
+    memmove(p->data.or.xs + j + 1, p->data.or.xs + k, (n - k) * sizeof(mpc_parser_t*));
+    p->data.or.n = n - (k - j - 1);
+    mpc_dispatch_delete(p->data.or.d); p->data.or.d = NULL;
+    return 1;
+  }
   
-  return err;
+  return 0;
 }
 
-static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
-
-  int i, total;
-
-  if (p->retained && !force) { return 0; }
-
-  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
-
-  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
-
-  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
-
-  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+static int mpc_optimise_literal(mpc_parser_t *p) {
+  if (p->retained) { return 0; }
+  if (p->type == MPC_TYPE_SINGLE) { return p->data.single.x != '\0'; }
+  return p->type == MPC_TYPE_STRING;
+}
 
-  if (p->type == MPC_TYPE_OR) { 
-    total = 0;
-    for(i = 0; i < p->data.or.n; i++) {
-      total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
-    }
-    return total;
-  }
+/* Merges runs of bare characters and strings in a string into one */
+static int mpc_optimise_and_literals(mpc_parser_t *p) {
   
-  if (p->type == MPC_TYPE_AND) {
-    total = 0;
-    for(i = 0; i < p->data.and.n; i++) {
-      total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
+  mpc_parser_t *t, *x;
+  size_t l;
+  int j, k, m, n = p->data.and.n;
+  
+  for (j = 0; j < n; j++) {
+    
+    if (!mpc_optimise_literal(p->data.and.xs[j])) { continue; }
+    for (k = j + 1; k < n && mpc_optimise_literal(p->data.and.xs[k]); k++);
+    if (k - j < 2) { continue; }
+    
+    for (m = j, l = 0; m < k; m++) {
+      x = p->data.and.xs[m];
+      l += x->type == MPC_TYPE_SINGLE ? 1 : strlen(x->data.string.x);
     }
-    return total;
+    
+    t = mpc_undefined();
+    t->type = MPC_TYPE_STRING;
+    t->data.string.x = malloc(l + 1);
+    for (m = j, l = 0; m < k; m++) {
+      x = p->data.and.xs[m];
+      if (x->type == MPC_TYPE_SINGLE) {
+        t->data.string.x[l++] = x->data.single.x;
+      } else {
+        strcpy(t->data.string.x + l, x->data.string.x);
+        l += strlen(x->data.string.x);
+      }
+      mpc_delete(x);
+    }
+    t->data.string.x[l] = '\0';
+    
+    /* The merged string is destructed as the last of it was */
+    p->data.and.xs[j] = t;
+    memmove(p->data.and.xs + j + 1, p->data.and.xs + k, (n - k) * sizeof(mpc_parser_t*));
+    memmove(p->data.and.dxs + j, p->data.and.dxs + k - 1, (n - k) * sizeof(mpc_dtor_t));
+    p->data.and.n = n - (k - j - 1);
+    return 1;
   }
+  
+  return 0;
+}
 
-  return 1;
+/* Splits the `and` `p` after its first parser, returning the rest */
+static mpc_parser_t *mpc_optimise_and_split(mpc_parser_t *p) {
+  
+  mpc_parser_t *t;
+  
+  if (p->data.and.n == 2) { return p->data.and.xs[1]; }
   
+  t = mpc_undefined();
+  t->type = MPC_TYPE_AND;
+  t->data.and.f = p->data.and.f;
+  t->data.and.n = p->data.and.n - 1;
+  t->data.and.xs = malloc(sizeof(mpc_parser_t*) * t->data.and.n);
+  t->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (t->data.and.n - 1));
+  memcpy(t->data.and.xs, p->data.and.xs + 1, t->data.and.n * sizeof(mpc_parser_t*));
+  memcpy(t->data.and.dxs, p->data.and.dxs + 1, (t->data.and.n - 1) * sizeof(mpc_dtor_t));
+  p->data.and.n = 2;
+  return t;
 }
 
-void mpc_stats(mpc_parser_t* p) {
-  printf("Stats\n");
-  printf("=====\n");
-  printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+/*
+** Hoists the first parser out of adjacent
+** alternatives which start with the same one.
+** Only folds which fold nested results the same
+** as flat ones are looked at - for an AST that
+** means an `and` of two, as a missing result
+** folds differently.
+*/
+static int mpc_optimise_or_prefix(mpc_parser_t *p, int within) {
+  
+  mpc_parser_t *a, *b, *t;
+  int j, n = p->data.or.n;
+  
+  for (j = 0; j + 1 < n; j++) {
+    
+    a = p->data.or.xs[j];
+    b = p->data.or.xs[j+1];
+    
+    if (a->retained || b->retained
+    ||  a->type != MPC_TYPE_AND || b->type != MPC_TYPE_AND
+    ||  a->data.and.f != b->data.and.f
+    ||  a->data.and.n < 2 || b->data.and.n < 2
+    ||  a->data.and.dxs[0] != b->data.and.dxs[0]
+    || !mpc_optimise_equal(a->data.and.xs[0], b->data.and.xs[0])) { continue; }
+    
+    if (!(a->data.and.f == mpcf_strfold
+    ||   (a->data.and.f == mpcf_fold_ast && a->data.and.n == 2 && b->data.and.n == 2))) { continue; }
+    
+    t = mpc_undefined();
+    t->type = MPC_TYPE_OR;
+    t->data.or.n = 2;
+    t->data.or.xs = malloc(sizeof(mpc_parser_t*) * 2);
+    t->data.or.d = NULL;
+    t->data.or.xs[0] = mpc_optimise_and_split(a);
+    t->data.or.xs[1] = mpc_optimise_and_split(b);
+    
+    mpc_delete(b->data.and.xs[0]);
+    free(b->data.and.xs); free(b->data.and.dxs); free(b->name); free(b);
+    
+    a->data.and.xs[1] = t;
+    mpc_optimise_unretained(t, 0, within);
+    
+    memmove(p->data.or.xs + j + 1, p->data.or.xs + j + 2, (n - j - 2) * sizeof(mpc_parser_t*));
+    p->data.or.n = n - 1;
+    mpc_dispatch_delete(p->data.or.d); p->data.or.d = NULL;
+    return 1;
+  }
+  
+  return 0;
 }
 
-static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
+static void mpc_optimise_unretained(mpc_parser_t *p, int force, int within) {
   
   int i, n, m;
   mpc_parser_t *t;
+  mpc_dfa_t *d;
   
   if (p->retained && !force) { return; }
   
   /* Optimise Subexpressions */
   
-  if (p->type == MPC_TYPE_EXPECT)   { mpc_optimise_unretained(p->data.expect.x, 0); }
-  if (p->type == MPC_TYPE_APPLY)    { mpc_optimise_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { mpc_optimise_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { mpc_optimise_unretained(p->data.predict.x, 0); }
-  if (p->type == MPC_TYPE_NOT)      { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE)    { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MANY)     { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_EXPECT)   { mpc_optimise_unretained(p->data.expect.x, 0, within | MPC_OPTIMISE_SUPPRESSED); }
+  if (p->type == MPC_TYPE_APPLY)    { mpc_optimise_unretained(p->data.apply.x, 0, within); }
+  if (p->type == MPC_TYPE_APPLY_TO) { mpc_optimise_unretained(p->data.apply_to.x, 0, within); }
+  if (p->type == MPC_TYPE_PREDICT)  { mpc_optimise_unretained(p->data.predict.x, 0, within | MPC_OPTIMISE_PREDICTIVE); }
+  if (p->type == MPC_TYPE_SPAN)     { mpc_optimise_unretained(p->data.span.x, 0, within); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_optimise_unretained(p->data.dfa.x, 0, within); }
+  if (p->type == MPC_TYPE_PACKRAT)  { mpc_optimise_unretained(p->data.packrat.x, 0, within); }
+  if (p->type == MPC_TYPE_NOT)      { mpc_optimise_unretained(p->data.not.x, 0, within | MPC_OPTIMISE_SUPPRESSED); }
+  if (p->type == MPC_TYPE_MAYBE)    { mpc_optimise_unretained(p->data.not.x, 0, within); }
+  if (p->type == MPC_TYPE_MANY)     { mpc_optimise_unretained(p->data.repeat.x, 0, within); }
+  if (p->type == MPC_TYPE_MANY1)    { mpc_optimise_unretained(p->data.repeat.x, 0, within); }
+  if (p->type == MPC_TYPE_COUNT)    { mpc_optimise_unretained(p->data.repeat.x, 0, within); }
   
   if (p->type == MPC_TYPE_OR) { 
     for(i = 0; i < p->data.or.n; i++) {
-      mpc_optimise_unretained(p->data.or.xs[i], 0);
+      mpc_optimise_unretained(p->data.or.xs[i], 0, within);
     }
   }
   
   if (p->type == MPC_TYPE_AND) {
     for(i = 0; i < p->data.and.n; i++) {
-      mpc_optimise_unretained(p->data.and.xs[i], 0);
+      mpc_optimise_unretained(p->data.and.xs[i], 0, within);
     }
   }  
   
@@ -3408,6 +5685,8 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
     && !p->data.or.xs[p->data.or.n-1]->retained) {
       t = p->data.or.xs[p->data.or.n-1];
       n = p->data.or.n; m = t->data.or.n;
+      mpc_dispatch_delete(p->data.or.d); p->data.or.d = NULL;
+      mpc_dispatch_delete(t->data.or.d);
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
@@ -3421,9 +5700,11 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
     && !p->data.or.xs[0]->retained) {
       t = p->data.or.xs[0];
       n = p->data.or.n; m = t->data.or.n;
+      mpc_dispatch_delete(p->data.or.d); p->data.or.d = NULL;
+      mpc_dispatch_delete(t->data.or.d);
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      memmove(p->data.or.xs + m, t->data.or.xs + 1, n * sizeof(mpc_parser_t*));
+      memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
       free(t->data.or.xs); free(t->name); free(t);
       continue;
@@ -3528,6 +5809,89 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
     
+    /* Remove suppressed `expect` */
+    if (p->type == MPC_TYPE_EXPECT
+    && (within & MPC_OPTIMISE_SUPPRESSED)
+    && !p->data.expect.x->retained) {
+      t = p->data.expect.x;
+      free(p->data.expect.m);
+      p->type = t->type; p->data = t->data;
+      free(t->name); free(t);
+      continue;
+    }
+    
+    /* Merge `apply` into `apply_to` */
+    if (p->type == MPC_TYPE_APPLY_TO
+    &&  p->data.apply_to.g == NULL
+    &&  p->data.apply_to.x->type == MPC_TYPE_APPLY
+    && !p->data.apply_to.x->retained) {
+      t = p->data.apply_to.x;
+      p->data.apply_to.x = t->data.apply.x;
+      p->data.apply_to.g = t->data.apply.f;
+      free(t->name); free(t);
+      continue;
+    }
+    
+    /* Remove `span` of `span` or DFA */
+    if (p->type == MPC_TYPE_SPAN
+    && (p->data.span.x->type == MPC_TYPE_SPAN || p->data.span.x->type == MPC_TYPE_DFA)
+    && !p->data.span.x->retained) {
+      t = p->data.span.x;
+      p->type = t->type; p->data = t->data;
+      free(t->name); free(t);
+      continue;
+    }
+    
+    /* Compile suppressed `span` to DFA */
+    if (p->type == MPC_TYPE_SPAN
+    && (within & MPC_OPTIMISE_SUPPRESSED)
+    &&  mpc_optimise_closed(p->data.span.x)
+    && (d = mpc_dfa_compile(p->data.span.x))) {
+      t = p->data.span.x;
+      p->type = MPC_TYPE_DFA;
+      p->data.dfa.x = t;
+      p->data.dfa.d = d;
+      continue;
+    }
+    
+    /* Merge `or` of characters */
+    if (p->type == MPC_TYPE_OR && mpc_optimise_or_class(p)) { continue; }
+    
+    /* Hoist `or` prefixes */
+    if (p->type == MPC_TYPE_OR
+    && !(within & MPC_OPTIMISE_PREDICTIVE)
+    &&  mpc_optimise_or_prefix(p, within)) { continue; }
+    
+    /* Remove suppressed single `or` */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.n == 1
+    && (within & MPC_OPTIMISE_SUPPRESSED)
+    && !p->data.or.xs[0]->retained) {
+      t = p->data.or.xs[0];
+      mpc_dispatch_delete(p->data.or.d);
+      free(p->data.or.xs);
+      p->type = t->type; p->data = t->data;
+      free(t->name); free(t);
+      continue;
+    }
+    
+    /* Merge re literals */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_strfold
+    &&  mpc_optimise_and_literals(p)) { continue; }
+    
+    /* Remove re single `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.n == 1
+    &&  p->data.and.f == mpcf_strfold
+    && !p->data.and.xs[0]->retained) {
+      t = p->data.and.xs[0];
+      free(p->data.and.xs); free(p->data.and.dxs);
+      p->type = t->type; p->data = t->data;
+      free(t->name); free(t);
+      continue;
+    }
+    
     return;
     
   }
@@ -3535,6 +5899,280 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
 }
 
 void mpc_optimise(mpc_parser_t *p) {
-  mpc_optimise_unretained(p, 1);
+  mpc_optimise_unretained(p, 1, 0);
+}
+
+/*
+** Analysis
+**
+** `mpc_analyse` works out which characters each
+** parser can start with, and whether it can
+** match nothing, going round any recursion
+** until that settles. Anything it can't tell,
+** or which depends on what came before, is
+** taken to start with anything. An alternative
+** of an `or` which can neither start with the
+** next character nor match nothing must fail
+** right there, without looking further, and
+** its error is then always the same - the one
+** it raises at the end of an empty input - so
+** that is worked out here too.
+*/
+
+typedef struct {
+  int num;
+  mpc_parser_t **ps;
+  unsigned char *sets;
+  int *nullable;
+} mpc_first_st_t;
+
+static int mpc_subparsers(mpc_parser_t *p, mpc_parser_t ***xs) {
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   *xs = &p->data.expect.x;   return 1;
+    case MPC_TYPE_APPLY:    *xs = &p->data.apply.x;    return 1;
+    case MPC_TYPE_APPLY_TO: *xs = &p->data.apply_to.x; return 1;
+    case MPC_TYPE_PREDICT:  *xs = &p->data.predict.x;  return 1;
+    case MPC_TYPE_SPAN:     *xs = &p->data.span.x;     return 1;
+    case MPC_TYPE_PACKRAT:  *xs = &p->data.packrat.x;  return 1;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:    *xs = &p->data.not.x;      return 1;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    *xs = &p->data.repeat.x;   return 1;
+    case MPC_TYPE_OR:       *xs = p->data.or.xs;       return p->data.or.n;
+    case MPC_TYPE_AND:      *xs = p->data.and.xs;      return p->data.and.n;
+    default: return 0;
+  }
+}
+
+static int mpc_first_find(mpc_first_st_t *st, mpc_parser_t *p) {
+  int j;
+  for (j = 0; j < st->num; j++) { if (st->ps[j] == p) { return j; } }
+  return -1;
+}
+
+/* Finds every retained parser used by `p` */
+static void mpc_first_collect(mpc_first_st_t *st, mpc_parser_t *p) {
+  
+  mpc_parser_t **xs;
+  int j, n;
+  
+  if (p->retained) {
+    if (mpc_first_find(st, p) >= 0) { return; }
+    st->num++;
+    st->ps = realloc(st->ps, sizeof(mpc_parser_t*) * st->num);
+    st->sets = realloc(st->sets, 32 * st->num);
+    st->nullable = realloc(st->nullable, sizeof(int) * st->num);
+    st->ps[st->num-1] = p;
+    memset(st->sets + 32 * (st->num-1), 0, 32);
+    st->nullable[st->num-1] = 0;
+  }
+  
+  n = mpc_subparsers(p, &xs);
+  for (j = 0; j < n; j++) { mpc_first_collect(st, xs[j]); }
+}
+
+/* Adds the possible first characters of `p` to `s` and returns if it can match nothing */
+static int mpc_first(mpc_first_st_t *st, mpc_parser_t *p, unsigned char *s, int force) {
+  
+  mpc_dfa_t *d;
+  int c, j, n = 0;
+  
+  if (p->retained && !force) {
+    j = mpc_first_find(st, p);
+    mpc_dfa_set_union(s, st->sets + 32 * j);
+    return st->nullable[j];
+  }
+  
+  if (mpc_dfa_class(p, s)) { return 0; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+      return 1;
+    
+    case MPC_TYPE_FAIL:
+      return 0;
+    
+    case MPC_TYPE_SATISFY:
+      for (c = 0; c < 256; c++) {
+        if (p->data.satisfy.f((char)c)) { mpc_dfa_set_add(s, c); }
+      }
+      return 0;
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { return 1; }
+      mpc_dfa_set_add(s, (unsigned char)p->data.string.x[0]);
+      return 0;
+    
+    case MPC_TYPE_DFA:
+      d = p->data.dfa.d;
+      for (c = 0; c < 256; c++) {
+        if (d->trans[d->start * 256 + c] >= 0) { mpc_dfa_set_add(s, c); }
+      }
+      return d->accept[d->start];
+    
+    case MPC_TYPE_EXPECT:   return mpc_first(st, p->data.expect.x, s, 0);
+    case MPC_TYPE_APPLY:    return mpc_first(st, p->data.apply.x, s, 0);
+    case MPC_TYPE_APPLY_TO: return mpc_first(st, p->data.apply_to.x, s, 0);
+    case MPC_TYPE_PREDICT:  return mpc_first(st, p->data.predict.x, s, 0);
+    case MPC_TYPE_SPAN:     return mpc_first(st, p->data.span.x, s, 0);
+    case MPC_TYPE_PACKRAT:  return mpc_first(st, p->data.packrat.x, s, 0);
+    
+    case MPC_TYPE_MAYBE:
+      mpc_first(st, p->data.not.x, s, 0);
+      return 1;
+    
+    case MPC_TYPE_MANY:
+      mpc_first(st, p->data.repeat.x, s, 0);
+      return 1;
+    
+    case MPC_TYPE_MANY1:
+      return mpc_first(st, p->data.repeat.x, s, 0);
+    
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n < 1) { return 1; }
+      return mpc_first(st, p->data.repeat.x, s, 0);
+    
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        n = mpc_first(st, p->data.or.xs[j], s, 0) || n;
+      }
+      return n;
+    
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_first(st, p->data.and.xs[j], s, 0)) { return 0; }
+      }
+      return 1;
+    
+    default:
+      memset(s, 0xFF, 32);
+      return 1;
+  }
+  
+}
+
+static void mpc_dispatch_build(mpc_first_st_t *st, mpc_parser_t *p) {
+  
+  int c, j, k = 0, n = p->data.or.n;
+  unsigned char *sets;
+  int *nullable;
+  mpc_dispatch_t *d;
+  mpc_input_t *i;
+  mpc_result_t r;
+  
+  mpc_dispatch_delete(p->data.or.d);
+  p->data.or.d = NULL;
+  if (n < 2) { return; }
+  
+  sets = calloc(n, 32);
+  nullable = malloc(sizeof(int) * n);
+  for (j = 0; j < n; j++) {
+    nullable[j] = mpc_first(st, p->data.or.xs[j], sets + 32 * j, 0);
+  }
+  
+  d = malloc(sizeof(mpc_dispatch_t));
+  d->n = n;
+  d->alts = malloc(sizeof(int) * n * 257);
+  d->at = calloc(n + 1, sizeof(int));
+  d->fails = NULL;
+  
+  for (c = 0; c < 257; c++) {
+    d->start[c] = k;
+    for (j = 0; j < n; j++) {
+      if (nullable[j] || (c < 256 && mpc_dfa_set_has(sets + 32 * j, c))) { d->alts[k++] = j; }
+    }
+  }
+  d->start[257] = k;
+  
+  free(sets);
+  
+  if (k == n * 257) {
+    free(nullable);
+    mpc_dispatch_delete(d);
+    return;
+  }
+  
+  i = mpc_input_new_nstring("<analyse>", "", 0);
+  for (j = 0; j < n; j++) {
+    d->at[j+1] = d->at[j];
+    if (nullable[j]) { continue; }
+    i->fails_num = 0;
+    if (mpc_parse_run(i, p->data.or.xs[j], &r) || i->exceeded) {
+      /* Unreachable if the analysis is sound, but be safe */
+      k = -1;
+      break;
+    }
+    if (i->fails_num == 0) { continue; }
+    d->at[j+1] += i->fails_num;
+    d->fails = realloc(d->fails, sizeof(mpc_fail_t) * d->at[j+1]);
+    memcpy(d->fails + d->at[j], i->fails, sizeof(mpc_fail_t) * i->fails_num);
+  }
+  mpc_input_delete(i);
+  free(nullable);
+  
+  if (k < 0) {
+    mpc_dispatch_delete(d);
+    return;
+  }
+  
+  p->data.or.d = d;
+}
+
+static void mpc_analyse_unretained(mpc_first_st_t *st, mpc_parser_t *p, int force) {
+  
+  mpc_parser_t **xs;
+  int j, n;
+  
+  if (p->retained && !force) { return; }
+  
+  n = mpc_subparsers(p, &xs);
+  for (j = 0; j < n; j++) { mpc_analyse_unretained(st, xs[j], 0); }
+  
+  if (p->type == MPC_TYPE_OR) { mpc_dispatch_build(st, p); }
+}
+
+static void mpc_analyse_all(int n, mpc_parser_t **ps) {
+  
+  mpc_first_st_t st;
+  unsigned char s[32];
+  int j, k, changed;
+  
+  st.num = 0;
+  st.ps = NULL;
+  st.sets = NULL;
+  st.nullable = NULL;
+  
+  for (j = 0; j < n; j++) { if (ps[j]) { mpc_first_collect(&st, ps[j]); } }
+  
+  do {
+    changed = 0;
+    for (j = 0; j < st.num; j++) {
+      memset(s, 0, 32);
+      k = mpc_first(&st, st.ps[j], s, 1);
+      if (k != st.nullable[j] || memcmp(s, st.sets + 32 * j, 32) != 0) {
+        st.nullable[j] = k;
+        memcpy(st.sets + 32 * j, s, 32);
+        changed = 1;
+      }
+    }
+  } while (changed);
+  
+  for (j = 0; j < n; j++) {
+    if (ps[j] && !ps[j]->retained) { mpc_analyse_unretained(&st, ps[j], 1); }
+  }
+  for (j = 0; j < st.num; j++) { mpc_analyse_unretained(&st, st.ps[j], 1); }
+  
+  free(st.ps);
+  free(st.sets);
+  free(st.nullable);
+}
+
+void mpc_analyse(mpc_parser_t *p) {
+  mpc_analyse_all(1, &p);
 }
 
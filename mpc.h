@@ -61,10 +61,34 @@ struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Inputs, for parsing one thing after
+** another from the same pipe, or with a
+** limit on how deeply parsers may nest
+*/
+
+struct mpc_input_t;
+typedef struct mpc_input_t mpc_input_t;
+
+mpc_input_t *mpc_input_new_nstring(const char *filename, const char *string, size_t length);
+mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe);
+void mpc_input_delete(mpc_input_t *i);
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r);
+
+/*
+** Parsers nest as deeply as memory allows,
+** but if `depth` is not 0 a parse of `i`
+** nesting any deeper fails with an error
+** instead. Returns the limit it replaces, 0
+** for a new input.
+*/
+int mpc_input_depth_limit(mpc_input_t *i, int depth);
+
 /*
 ** Function Types
 */
@@ -133,6 +157,18 @@ mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
+mpc_parser_t *mpc_span(mpc_parser_t *a);
+
+/*
+** Packrat parsing: what `a` made at each
+** position is remembered for as long as the
+** input could backtrack there, so it is not
+** parsed twice. As results belong to whoever
+** takes them, the remembered one is handed
+** out as a `copy` and deleted with `da`, so
+** for ASTs `mpc_ast_share` keeps that cheap.
+*/
+mpc_parser_t *mpc_packrat(mpc_parser_t *a, mpc_apply_t copy, mpc_dtor_t da);
 
 /*
 ** Common Parsers
@@ -255,14 +291,47 @@ mpc_parser_t *mpc_re(const char *re);
 ** AST
 */
 
+/*
+** `id` is the rule that made a node: for a grammar built by `mpca_lang`
+** or `mpca_grammar`, the position (counting from one) of the innermost
+** rule's parser among the parsers passed in. It is `MPC_AST_NONE` for
+** nodes made by no rule, `MPC_AST_LITERAL` for string and char literals
+** in the grammar, and `MPC_AST_ROOT` for nodes made by `mpc_ast_add_root`.
+*/
+
+enum {
+  MPC_AST_NONE    =  0,
+  MPC_AST_ROOT    = -1,
+  MPC_AST_LITERAL = -2
+};
+
+typedef struct mpc_ast_arena_t mpc_ast_arena_t;
+
 typedef struct mpc_ast_t {
   char *tag;
+  int id;
   char *contents;
   mpc_state_t state;
   int children_num;
+  int children_max;
   struct mpc_ast_t** children;
+  mpc_ast_arena_t *arena;
+  int refs;
 } mpc_ast_t;
 
+/*
+** While an arena is in use (on the calling thread), new AST nodes are
+** allocated from it, and `mpc_ast_delete` does nothing to them: they
+** are all freed by `mpc_ast_arena_reset`. Tags given to the AST
+** functions meanwhile are cached by address, so must not change.
+** `mpc_ast_arena_use` returns the arena that was in use before.
+*/
+
+mpc_ast_arena_t *mpc_ast_arena_new(void);
+mpc_ast_arena_t *mpc_ast_arena_use(mpc_ast_arena_t *a);
+void mpc_ast_arena_reset(mpc_ast_arena_t *a);
+void mpc_ast_arena_delete(mpc_ast_arena_t *a);
+
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
@@ -270,6 +339,15 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
+
+/*
+** `mpc_ast_share` hands out another reference to `a` rather than a copy,
+** counted in `refs`, and each is given up with `mpc_ast_delete`. The
+** functions above which change a node change a copy of it instead if it
+** is shared, which shares its children in turn.
+*/
+mpc_ast_t *mpc_ast_share(mpc_ast_t *a);
 
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
@@ -303,7 +381,9 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_DROP_LITERALS        = 4,
+  MPCA_LANG_PACKRAT              = 8
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -322,6 +402,15 @@ void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
 
+/*
+** Gives every `or` used by `p` a table of which
+** alternatives to try for each next character.
+** `mpca_lang` does this for the parsers it is
+** given. Run it again if any parser used by `p`
+** is redefined afterwards.
+*/
+void mpc_analyse(mpc_parser_t *p);
+
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
   int(*tester)(const void*, const void*), 
   mpc_dtor_t destructor, 
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Checks the results of futures (`future`, `deref` and `realized?`), which are
+# evaluated on the background executor, including when `deref` times out.
+#
+# Usage: tests/futures.sh [path/to/lispy]
+
+lispy=${1:-./lispy}
+failed=0
+
+check() {
+  source=$1
+  expected=$2
+  actual=$(printf '%s' "$source" | "$lispy" - 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: lispy reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+check '(def {f} (future {+ 1 2})) (print (deref f) (realized? f) (deref f))' \
+  "3 true 3 "
+check '(print (deref (future {* 6 7}) 1000 "late"))' "42 "
+check '(print (map (\ {f} {deref f}) (map (\ {n} {future {* n n}}) {1 2 3 4})))' \
+  "{1 4 9 16} "
+
+# The body can still see the arguments of the call that made it
+check '(def\ {later n} {future {* n 2}}) (def {f} (later 21)) (print (deref f))' \
+  "42 "
+
+# A future that takes longer than `deref` waits is still realized in the end
+check '(def {f} (future {transduce (mapping (\ {x} {* x 2})) + 0 (range 300000)}))
+       (print (deref f 0 "late") (realized? f) (deref f) (realized? f))' \
+  "\"late\" false 89999700000 true "
+
+check '(print (deref (future {error "boom"})))' "Error: boom"
+check '(future 1)' \
+  "Error: Incorrect type for argument #1 passed to 'future'. Got Long, expected Q-expression."
+check '(deref 1)' \
+  "Error: Incorrect type for argument #1 passed to 'deref'. Got Long, expected Future."
+check '(deref (future {+ 1}) 10)' \
+  "Error: Function 'deref' passed incorrect number of arguments. Got 2, expected 1 or 3."
+
+if [ $failed -eq 0 ]; then echo "futures: ok"; fi
+exit $failed
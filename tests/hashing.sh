@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Checks that `hash` and `==` agree on structurally equal values, and that
+# turning hash-consing on (`(hash-cons true)`) changes no comparison.
+#
+# Usage: tests/hashing.sh [path/to/lispy]
+
+lispy=${1:-./lispy}
+failed=0
+
+check() {
+  source=$1
+  expected=$2
+  actual=$(printf '%s' "$source" | "$lispy" - 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: lispy reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+check '(print (== (hash {1 2 "a"}) (hash {1 2 "a"})) (== {1 {2 "x"}} {1 {2 "x"}}) (!= "a" "b") (== 1 1.0))' \
+  "true true true false "
+check '(print (== (hash [1 2 3 4]) (hash [3 4 1 2])) (== (hash #{1 2}) (hash #{2 1})))' \
+  "true true "
+
+lists='(def {a} (force (range 5000))) (def {b} (force (range 5000))) (def {c} (join (init b) {0}))'
+for on in false true; do
+  check "(hash-cons $on) $lists
+         (print (== a b) (== a c) (== (hash a) (hash b)) (== (tail a) (tail b)) (== (init c) (init a)))" \
+    "true false true true true "
+  check "(hash-cons $on) (def {s} \"héllo\") (def {t} (join \"hé\" \"llo\"))
+         (print (== s t) (== (hash s) (hash t)) (== (tail s) \"éllo\"))" \
+    "true true true "
+done
+
+# Values read while it was on still compare by value once it's off
+check "(hash-cons true) $lists (hash-cons false) (print (== a b) (== a c) (== (hash a) (hash c)))" \
+  "true false false "
+
+check '(hash-cons 1)' \
+  "Error: Incorrect type for argument #1 passed to 'hash-cons'. Got Long, expected Boolean."
+
+if [ $failed -eq 0 ]; then echo "hashing: ok"; fi
+exit $failed
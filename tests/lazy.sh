@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Checks lazy sequences: what each of the generators and lazy operations
+# produces, and that elements are only realized a chunk at a time as they're
+# asked for.
+#
+# Usage: tests/lazy.sh [path/to/lispy]
+
+lispy=${1:-./lispy}
+failed=0
+
+check() {
+  source=$1
+  expected=$2
+  actual=$(printf '%s' "$source" | "$lispy" - 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: lispy reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+check '(print (force (range 3)) (force (range 2 5)) (force (range 10 0 -3)) (force (range 0 1 2)))' \
+  "{0 1 2} {2 3 4} {10 7 4 1} {0} "
+check '(print (force (lazy-take 5 (range))) (nth (range) 100) (len (range 70)))' \
+  "{0 1 2 3 4} 100 70 "
+check '(print (force (lazy-take 3 (lazy-map (\ {x} {* x x}) (range 10)))))' \
+  "{0 1 4} "
+check '(print (force (lazy-take 3 (lazy-filter (\ {x} {> x 1000}) (range)))))' \
+  "{1001 1002 1003} "
+check '(print (force (lazy-take 3 (iterate (\ {x} {* x 2}) 1))))' "{1 2 4} "
+check '(print (force (lazy-take 4 (cycle {1 2}))) (force (cycle {})) (force (repeat 3 "r")))' \
+  "{1 2 1 2} {} {\"r\" \"r\" \"r\"} "
+check '(print (force (lazy-concat (range 2) (range 3))) (force (lazy-drop 2 (range 5))))' \
+  "{0 1 0 1 2} {2 3 4} "
+check '(print (head (range 5)) (first (range 7 9)) (lazy? (range)) (lazy? {1}) (range))' \
+  "{0} 7 true false <Lazy sequence> "
+
+# Asking for the first element realizes only the first chunk of 32
+check '(def {n} 0)
+       (def {s} (lazy-map (\ {x} {do (def {n} (+ n 1)) x}) (range 100)))
+       (print n (first s) n (nth s 40) n)' \
+  "0 0 32 40 64 "
+
+check '(range 0 10 0)' "Error: Step passed to 'range' can't be zero."
+check '(force 1)' \
+  "Error: Incorrect type for argument #1 passed to 'force'. Got Long, expected Q-expression or Lazy sequence."
+
+if [ $failed -eq 0 ]; then echo "lazy: ok"; fi
+exit $failed
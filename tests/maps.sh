@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Checks hash maps, from `hash-map` and from [key value ...] literals: looking
+# keys up, adding and removing them without changing the map they came from,
+# and comparing maps whatever order their keys were added in.
+#
+# Usage: tests/maps.sh [path/to/lispy]
+
+lispy=${1:-./lispy}
+failed=0
+
+check() {
+  source=$1
+  expected=$2
+  actual=$(printf '%s' "$source" | "$lispy" - 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: lispy reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+check '(print (hash-map 1 "a" 2 "b") (hash-map) [] (len [1 2 3 4]))' \
+  "[1 \"a\" 2 \"b\"] [] [] 2 "
+check '(print (get (hash-map 1 "a") 1) (get (hash-map) 5 "d") (contains-key? [1 2] 1) (contains-key? [1 2] 2))' \
+  "\"a\" \"d\" true false "
+check '(print (keys [1 2]) (vals [1 2]) (sort (keys [5 1 3 4 2 0])))' \
+  "{1} {2} {2 3 5} "
+
+# Keys of different types, or made of lists and maps, are looked up by value
+check '(print (get [{1 2} "v"] {1 2}) (get [1.0 "d" 1 "l"] 1) (get [1.0 "d" 1 "l"] 1.0) (get ["é" 1] "é"))' \
+  "\"v\" \"l\" \"d\" 1 "
+
+# The last value given for a key wins
+check '(print [1 2 1 3] (hash-map 1 2 1 3))' "[1 3] [1 3] "
+
+check '(def {a} [1 2]) (def {b} (assoc a 3 4)) (def {c} (dissoc b 1)) (print a b c (dissoc [] 1))' \
+  "[1 2] [3 4 1 2] [3 4] [] "
+check '(print (== (hash-map 1 2 3 4) (hash-map 3 4 1 2)) (== [1 2] [1 3]) (== [1 2] (dissoc [1 2 3 4] 3)))' \
+  "true false true "
+
+check '(def {big} (transduce (mapping (\ {i} {+ i 0})) (\ {m i} {assoc m i (* i i)}) (hash-map) (range 10000)))
+       (print (len big) (get big 9999) (get big 10000 "none") (len (dissoc big 5)) (get (dissoc big 5) 5 "gone")
+              (== big (dissoc (assoc big -1 0) -1)))' \
+  "10000 99980001 \"none\" 9999 \"gone\" true "
+
+check '(get (hash-map) 5)' "Error: Key not found in map passed to 'get'."
+check '(get 1 1)' \
+  "Error: Incorrect type for argument #1 passed to 'get'. Got Long, expected Map."
+check '(hash-map 1)' \
+  "Error: Function 'hash-map' passed an odd number of arguments. Expected keys and values in pairs."
+check '(print [1])' "Error: Map literal has a key with no value."
+
+if [ $failed -eq 0 ]; then echo "maps: ok"; fi
+exit $failed
@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Checks that an `or` which skips alternatives by their next character (see
+# mpc_analyse) parses and reports errors just as trying every one would, also
+# when a predictive alternative fails after taking some of the input.
+#
+# Usage: tests/mpc_dispatch.sh
+
+dir=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+${CC:-cc} -std=c99 -o "$tmp/mpc_grammar" "$dir/mpc_grammar.c" "$dir/../mpc.c" -lm || exit 1
+failed=0
+
+check() {
+  flags=$1
+  grammar=$2
+  source=$3
+  expected=$4
+  actual=$(printf '%s' "$source" | "$tmp/mpc_grammar" "$flags" "$grammar" s a 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: $flags grammar $grammar reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+# Each alternative is tried where the one before left the input
+grammar="s : '(' 'y' | 'x' | '(' 'w' | 'z' ;"
+for flags in default packrat; do
+  check $flags "$grammar" "(q" "<stdin>:1:2: error: expected 'y' or 'w' at 'q'"
+done
+for flags in predictive predictive,packrat; do
+  check $flags "$grammar" "(q" \
+    "<stdin>:1:2: error: expected 'y', 'x', '(' or 'z' at 'q'"
+done
+
+grammar="s : '(' 'y' | 'q' ;"
+for flags in default packrat; do
+  check $flags "$grammar" "(q" "<stdin>:1:2: error: expected 'y' at 'q'"
+done
+for flags in predictive predictive,packrat; do
+  check $flags "$grammar" "(q" "char:1:2 'q'"
+done
+
+# Without any backtracking to tell them apart, the flags all agree
+grammar="s : <a>* 'z' ; a : '(' <a>* ')' | 'x' | 'y' ;"
+for flags in default predictive packrat predictive,packrat; do
+  check $flags "$grammar" "x(y)q" \
+    "<stdin>:1:5: error: expected '(', 'x', 'y' or 'z' at 'q'"
+done
+
+if [ $failed -eq 0 ]; then echo "mpc dispatch: ok"; fi
+exit $failed
@@ -0,0 +1,69 @@
+/*
+ * Parses standard input with a grammar given to mpca_lang and prints the AST,
+ * or the error, for the mpc tests in this directory.
+ *
+ * Usage: mpc_grammar [-q] flags grammar rule...
+ *
+ * `flags` is a comma-separated list of any of `predictive` and `packrat`, or
+ * `default`. The input is parsed with the first rule named. With `-q` the AST
+ * is not printed, only whether it parsed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../mpc.h"
+
+#define MAX_RULES 16
+
+int main(int argc, char** argv) {
+  int quiet = argc > 1 && strcmp(argv[1], "-q") == 0;
+  if (quiet) { argc--; argv++; }
+  if (argc < 4 || argc - 3 > MAX_RULES) {
+    fprintf(stderr, "Usage: mpc_grammar [-q] flags grammar rule...\n");
+    return 2;
+  }
+
+  int flags = MPCA_LANG_DEFAULT;
+  if (strstr(argv[1], "predictive")) { flags |= MPCA_LANG_PREDICTIVE; }
+  if (strstr(argv[1], "packrat"))    { flags |= MPCA_LANG_PACKRAT; }
+
+  mpc_parser_t* rules[MAX_RULES + 1] = { NULL };
+  int rules_num = argc - 3;
+  for (int i = 0; i < rules_num; i++) { rules[i] = mpc_new(argv[i + 3]); }
+
+  mpc_err_t* err = mpca_lang(flags, argv[2],
+    rules[0],  rules[1],  rules[2],  rules[3],  rules[4],  rules[5],
+    rules[6],  rules[7],  rules[8],  rules[9],  rules[10], rules[11],
+    rules[12], rules[13], rules[14], rules[15], NULL);
+  if (err) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    return 2;
+  }
+
+  size_t len = 0, max = 4096;
+  char* input = malloc(max);
+  size_t n;
+  while ((n = fread(input + len, 1, max - len, stdin)) > 0) {
+    len += n;
+    if (len == max) { max *= 2; input = realloc(input, max); }
+  }
+
+  mpc_result_t r;
+  int ok = mpc_nparse("<stdin>", input, len, rules[0], &r);
+  if (ok) {
+    if (!quiet) { mpc_ast_print(r.output); }
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+
+  free(input);
+  mpc_cleanup(rules_num,
+    rules[0],  rules[1],  rules[2],  rules[3],  rules[4],  rules[5],
+    rules[6],  rules[7],  rules[8],  rules[9],  rules[10], rules[11],
+    rules[12], rules[13], rules[14], rules[15]);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+#!/bin/sh
+#
+# Checks that a packrat grammar (MPCA_LANG_PACKRAT) builds the same AST as
+# trying every alternative afresh, and that taking a rule's result from the
+# memo costs the same however big it is, so backtracking over nested input
+# stays linear.
+#
+# Usage: tests/mpc_packrat.sh
+
+dir=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+${CC:-cc} -std=c99 -O2 -o "$tmp/mpc_grammar" "$dir/mpc_grammar.c" "$dir/../mpc.c" -lm || exit 1
+failed=0
+
+# Each level is parsed once as the 'x' alternative before it backtracks
+grammar="a : '(' <a> ')' 'x' | '(' <a> ')' 'y' | 'z' ;"
+
+nested() {
+  awk -v n="$1" -v end="$2" 'BEGIN {
+    for (i = 0; i < n; i++) { printf "(" }
+    printf "z"
+    for (i = 0; i < n; i++) { printf ")%s", substr(end, i % length(end) + 1, 1) }
+  }'
+}
+
+check() {
+  source=$1
+  expected=$(printf '%s' "$source" | "$tmp/mpc_grammar" default "$grammar" a 2>&1)
+  actual=$(printf '%s' "$source" | "$tmp/mpc_grammar" packrat "$grammar" a 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: packrat reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+check "z"
+check "$(nested 6 y)"
+check "$(nested 6 x)"
+check "$(nested 6 xyyx)"
+check "$(nested 6 y | sed 's/y$/q/')"
+
+# Milliseconds to parse `n` levels ending in 'y', the fastest of three runs
+elapsed() {
+  nested "$1" y > "$tmp/nested"
+  best=
+  for run in 1 2 3; do
+    start=$(date +%s%N)
+    "$tmp/mpc_grammar" -q packrat "$grammar" a < "$tmp/nested" || failed=1
+    ms=$(( ($(date +%s%N) - start) / 1000000 ))
+    if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then best=$ms; fi
+  done
+  echo "$best"
+}
+
+# Eight times the levels should take about eight times as long, where
+# copying the memoised ASTs took well over sixty-four
+small=$(elapsed 500)
+large=$(elapsed 4000)
+if [ "$large" -gt $(( (small + 1) * 24 )) ]; then
+  echo "FAIL: packrat took ${small}ms for 500 levels but ${large}ms for 4000"
+  failed=1
+fi
+
+if [ $failed -eq 0 ]; then echo "mpc packrat: ok"; fi
+exit $failed
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Checks that evaluating the arguments of an S-expression in parallel
+# (`(parallel true)`) gives the same results and errors as evaluating them in
+# turn.
+#
+# Usage: tests/parallel.sh [path/to/lispy]
+
+lispy=${1:-./lispy}
+failed=0
+
+check() {
+  source=$1
+  expected=$2
+  actual=$(printf '%s' "$source" | "$lispy" - 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: lispy reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+fib='(def\ {fib n} {if (< n 2) {+ n 0} {+ (fib (- n 1)) (fib (- n 2))}})'
+
+check '(parallel true) (print (+ (* 2 3) (* 4 5) (- 9 1)))' "34 "
+check "$fib (def {a} (fib 18)) (parallel true) (print a (fib 18))" "2584 2584 "
+check '(def {x} 5) (parallel true) (print (list (+ x x) (* x x) (- x)))' \
+  "{10 25 -5} "
+check '(parallel true) (print (sum (map (\ {x} {* x x}) (force (range 100)))))' \
+  "328350 "
+check '(parallel true) (parallel false) (print (* 3 4))' "12 "
+
+# The first argument to fail is the error, wherever it was evaluated
+check '(parallel true) (print (+ 1 (error "boom") (* 2 2)))' "Error: boom"
+check '(parallel true) (print (+ (* 2 2) (head {}) (error "boom")))' \
+  "Error: Empty Q-expression passed to 'head' as argument #1."
+
+check '(parallel 1)' \
+  "Error: Incorrect type for argument #1 passed to 'parallel'. Got Long, expected Boolean."
+
+if [ $failed -eq 0 ]; then echo "parallel: ok"; fi
+exit $failed
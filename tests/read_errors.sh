@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Checks the errors reported for unterminated string and char literals, by
+# both the hand-written reader and the mpc grammar (`--mpc`).
+#
+# Usage: tests/read_errors.sh [path/to/lispy]
+
+lispy=${1:-./lispy}
+failed=0
+
+check() {
+  flag=$1
+  source=$2
+  expected=$3
+  actual=$(printf '%s' "$source" | "$lispy" $flag - 2>&1 | grep 'error:')
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: lispy $flag reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+check "" '(print "abc' \
+  "Error: <stdin>:1:12: error: expected '\"' at end of input"
+check "" "(print 'a" \
+  "Error: <stdin>:1:10: error: expected ''' at end of input"
+
+check --mpc '(print "abc' \
+  "Error: <stdin>:1:12: error: expected '\\', none of '\"\\' or '\"' at end of input"
+check --mpc "(print 'a" \
+  "Error: <stdin>:1:10: error: expected none of ''' or ''' at end of input"
+
+if [ $failed -eq 0 ]; then echo "read errors: ok"; fi
+exit $failed
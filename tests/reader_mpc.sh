@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Checks that the hand-written reader reads source into the same values as the
+# mpc grammar (`--mpc`), built with each of the mpca_lang flags that it can be,
+# both from a file and from a pipe.
+#
+# Usage: tests/reader_mpc.sh [path/to/lispy]
+
+lispy=${1:-./lispy}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+modes="--mpc --mpc=default --mpc=predictive --mpc=drop-literals --mpc=packrat
+       --mpc=predictive,packrat --mpc=predictive,drop-literals,packrat"
+
+check() {
+  source=$1
+  printf '%s' "$source" > "$tmp/source.lspy"
+  expected=$("$lispy" "$tmp/source.lspy" 2>&1)
+  for mode in $modes; do
+    for input in "$tmp/source.lspy" -; do
+      actual=$("$lispy" $mode "$input" < "$tmp/source.lspy" 2>&1)
+      if [ "$actual" != "$expected" ]; then
+        echo "FAIL: lispy $mode $input reading $source"
+        echo "  expected: $expected"
+        echo "  actual:   $actual"
+        failed=1
+      fi
+    done
+  done
+}
+
+check '(print 1 -2 3.5 -0.25 "a\"b\\c\n" (head {x}))'
+check '(print {} {{}} {1 {2 {3}} + - x_y? a->b})'
+check '(print (head {a b}) (tail {a b}) (list 1 2))'
+check "(print 'a' '\\n' '\\'' \"é\" 'é' \"日本\")"
+check '(print [] [1 2 "k" {v}] #{} #{1 2 {3}})'
+check '(print [1 [2 #{3}]] {[1 2] #{x}})'
+check '; only a comment'
+check '(print 1) ; after
+; between
+(print {1 ; inside
+ 2} [3 ; in a map
+ 4] #{5 ; in a set
+})'
+check '(def {x} 5) (print x) (print (* x x))'
+check '(print (unknown))'
+check '(print [1])'
+check ''
+
+if [ $failed -eq 0 ]; then echo "reader and mpc: ok"; fi
+exit $failed
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Checks record types made by `defrecord`: the constructor, accessors and
+# predicate it defines, and that records compare and hash by type and value.
+#
+# Usage: tests/records.sh [path/to/lispy]
+
+lispy=${1:-./lispy}
+failed=0
+
+check() {
+  source=$1
+  expected=$2
+  actual=$(printf '%s' "$source" | "$lispy" - 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: lispy reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+point='(defrecord {Point} {x y})'
+
+check "$point (def {pt} (Point 1 2)) (print pt (Point-x pt) (Point-y pt) (Point? pt) (Point? 5) Point-x)" \
+  "#Point{x 1 y 2} 1 2 true false <Point-x> "
+check "$point (def {a} (Point {1} \"s\")) (print (Point-x a) (Point-y a) (Point? (Point-x a)))" \
+  "{1} \"s\" false "
+check '(defrecord {P} {}) (print (P) (P? (P)))' "#P{} true "
+
+# Records of different types are never equal, even with the same fields
+check "$point (print (== (Point 1 2) (Point 1 2)) (!= (Point 1 2) (Point 2 1)) (== (hash (Point 1 2)) (hash (Point 1 2))))" \
+  "true true true "
+check "$point (defrecord {Pair} {x y}) (print (== (Point 1 2) (Pair 1 2)) (Pair? (Point 1 2)))" \
+  "false false "
+check "$point (print (len (set (list (Point 1 2) (Point 1 2) (Point 2 1)))) (get (assoc (hash-map) (Point 1 2) \"p\") (Point 1 2)))" \
+  "2 \"p\" "
+check "$point (print (map Point-y (list (Point 1 2) (Point 3 4))) (sort-by Point-x (list (Point 3 0) (Point 1 0))))" \
+  "{2 4} {#Point{x 1 y 0} #Point{x 3 y 0}} "
+
+# Defining a type again replaces it
+check "$point (defrecord {Point} {x y z}) (print (Point 1 2 3))" "#Point{x 1 y 2 z 3} "
+
+check "$point (Point 1)" \
+  "Error: Invalid number of arguments passed to 'Point'. Got 1, expected 2."
+check "$point (defrecord {Size} {w}) (Point-x (Size 1))" \
+  "Error: Incorrect type for argument #1 passed to 'Point-x'. Got Size, expected Point."
+check '(defrecord {P} {x x})' "Error: Duplicate field 'x' passed to 'defrecord'."
+check '(defrecord 1 {x})' \
+  "Error: Incorrect type for argument #1 passed to 'defrecord'. Got Long, expected Q-expression."
+
+if [ $failed -eq 0 ]; then echo "records: ok"; fi
+exit $failed
@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Checks hash sets, from `set` and from #{...} literals: membership, adding
+# and removing elements, union, intersection and difference, and building a
+# set from a whole collection at once.
+#
+# Usage: tests/sets.sh [path/to/lispy]
+
+lispy=${1:-./lispy}
+failed=0
+
+check() {
+  source=$1
+  expected=$2
+  actual=$(printf '%s' "$source" | "$lispy" - 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: lispy reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+check '(print (set) #{} (conj (set) 4) (disj #{1 2} 1) (len #{1 1 2}) (len (set {1 2 2 3})))' \
+  "#{} #{} #{4} #{2} 2 3 "
+check '(print (contains? #{1} 1) (contains? #{1} 2) (contains? #{{1 2} "a" [1 2]} {1 2}) (contains? #{{1 2} "a" [1 2]} [1 2]))' \
+  "true false true true "
+check "(print (contains? {1 2} 2) (contains? \"abc\" 'b') (contains? [1 2] 1))" \
+  "true true true "
+check '(print (== (set {1 2 2 3}) #{3 2 1}) (== #{1} #{1 2}) (== (set (range 5)) (disj #{0 1 2 3 4 5} 5)))' \
+  "true false true "
+
+check '(print (union #{1} #{2}) (intersection #{1 2} #{2 3}) (difference #{1 2} #{2}) (union #{} #{}) (intersection #{1} #{2}))' \
+  "#{1 2} #{2} #{1} #{} #{} "
+check '(def {s} (set (range 100000))) (def {t} (set (force (range 50000 150000))))
+       (print (len (union s t)) (len (intersection s t)) (len (difference s t))
+              (contains? (difference s t) 49999) (contains? (difference s t) 50000))' \
+  "150000 50000 50000 true false "
+
+check '(set 1)' \
+  "Error: Incorrect type for argument #1 passed to 'set'. Got Long, expected Q-expression or Lazy sequence."
+check '(contains? 1 1)' \
+  "Error: Incorrect type for argument #1 passed to 'contains?'. Got Long, expected Set, Map, Q-expression or String."
+check '(union #{1} {2})' \
+  "Error: Incorrect type for argument #2 passed to 'union'. Got Q-expression, expected Set."
+
+if [ $failed -eq 0 ]; then echo "sets: ok"; fi
+exit $failed
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Checks that `head`, `tail`, `init`, `take` and `drop` of lists and strings,
+# which share their contents with what they were taken from, hold the right
+# elements, and that adding to one changes neither.
+#
+# Usage: tests/slices.sh [path/to/lispy]
+
+lispy=${1:-./lispy}
+failed=0
+
+check() {
+  source=$1
+  expected=$2
+  actual=$(printf '%s' "$source" | "$lispy" - 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: lispy reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+check '(def {big} (force (range 300))) (def {t} (drop 290 big))
+       (print (len t) (take 3 t) (nth t 9) (== (drop 1 big) (tail big)) (init (take 3 big)) (len (init big)))' \
+  "10 {290 291 292} 299 true {0 1} 299 "
+check '(print (take 0 {1}) (drop 9 {1 2}) (take 9 {1 2}) (tail {1}) (init {1}))' \
+  "{} {} {1 2} {} {} "
+
+check '(def {a} {1 2 3 4}) (def {b} (tail a)) (print a b (conj b 5) (cons 0 b) (join (init a) {9}) a b)' \
+  "{1 2 3 4} {2 3 4} {2 3 4 5} {0 2 3 4} {1 2 3 9} {1 2 3 4} {2 3 4} "
+check '(def {a} {1 2 3}) (def {b} (take 2 a)) (def {c} (conj b 9)) (print a b c (nth a 2))' \
+  "{1 2 3} {1 2} {1 2 9} 3 "
+
+check '(def {s} "abcdef") (def {t} (tail s)) (print (join t "!") s t (head t) (drop 2 t) (take 2 (drop 1 t)))' \
+  "\"bcdef!\" \"abcdef\" \"bcdef\" \"b\" \"def\" \"cd\" "
+
+if [ $failed -eq 0 ]; then echo "slices: ok"; fi
+exit $failed
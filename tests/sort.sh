@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Checks `sort` and `sort-by`: the natural order of each kind of element,
+# comparing longs with doubles exactly, keeping equal elements in the order
+# they came in, and sorting the same way with parallel evaluation on.
+#
+# Usage: tests/sort.sh [path/to/lispy]
+
+lispy=${1:-./lispy}
+failed=0
+
+check() {
+  source=$1
+  expected=$2
+  actual=$(printf '%s' "$source" | "$lispy" - 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: lispy reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+check "(print (sort {3 1 2}) (sort {\"b\" \"a\" \"ab\"}) (sort {'b' 'a'}) (sort {}) (sort {1}) (sort (range 5 0 -1)))" \
+  "{1 2 3} {\"a\" \"ab\" \"b\"} {'a' 'b'} {} {1} {1 2 3 4 5} "
+check '(print (sort (\ {x y} {> x y}) {1 3 2}) (sort-by (\ {x} {- 0 x}) {1 3 2}) (sort-by len {"ccc" "a" "bb"}))' \
+  "{3 2 1} {3 2 1} {\"a\" \"bb\" \"ccc\"} "
+
+# Longs beyond what a double holds exactly are still told apart from doubles
+check '(print (sort {1.5 1 -2}) (sort {2 1.5 -0.0 0 1}))' \
+  "{-2 1 1.500000} {-0.000000 0 1 1.500000 2} "
+check '(print (sort {9007199254740993 9007199254740992.0 9007199254740992}))' \
+  "{9007199254740992.000000 9007199254740992 9007199254740993} "
+
+check '(print (sort-by (\ {p} {nth p 1}) {{a 2} {b 1} {c 2} {d 0}}))' \
+  "{{d 0} {b 1} {a 2} {c 2}} "
+check '(def {big} (force (range 100000 0 -1)))
+       (def {s} (sort big)) (def {t} (sort-by (\ {x} {% x 7}) big))
+       (parallel true)
+       (print (take 3 s) (nth s 99999) (take 3 t) (== s (sort big)) (== t (sort-by (\ {x} {% x 7}) big)))' \
+  "{1 2 3} 100000 {99995 99988 99981} true true "
+
+check '(sort {1 "a"})' \
+  "Error: Can't sort Long and String without a comparator passed to 'sort'."
+check '(sort 1)' \
+  "Error: Incorrect type for argument #1 passed to 'sort'. Got Long, expected Q-expression or Lazy sequence."
+check '(sort (\ {x} {x}) {2 1})' \
+  "Error: Function passed too many arguments. Got 2, expected 1."
+
+if [ $failed -eq 0 ]; then echo "sort: ok"; fi
+exit $failed
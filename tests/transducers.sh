@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Checks that transducer pipelines (`transduce` with `mapping`, `filtering`,
+# `taking`, `dropping` and `comp`) fold each element through every step in
+# turn, and stop taking elements once `taking` has all it needs.
+#
+# Usage: tests/transducers.sh [path/to/lispy]
+
+lispy=${1:-./lispy}
+failed=0
+
+check() {
+  source=$1
+  expected=$2
+  actual=$(printf '%s' "$source" | "$lispy" - 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: lispy reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+check '(print (transduce (comp (mapping (\ {x} {* x 10})) (filtering (\ {x} {> x 20})) (taking 3)) + 0 (range)))' \
+  "120 "
+check '(print (transduce (comp (taking 5) (dropping 2) (mapping (\ {x} {- x}))) conj {} (range)))' \
+  "{-2 -3 -4} "
+check '(print (transduce (dropping 2) conj {} {1 2 3 4}) (transduce (taking 2) conj {} (force (range 5))))' \
+  "{3 4} {0 1} "
+check '(print (transduce (filtering (\ {x} {== 0 (% x 2)})) + 0 (range 10)))' "20 "
+check '(print (transduce (mapping (\ {x} {* x 2})) (\ {acc x} {cons x acc}) {} {1 2 3}))' \
+  "{6 4 2} "
+check '(print (transduce (mapping (\ {x} {+ x 1})) conj {} {}))' "{} "
+
+# Elements after the last one taken are never mapped
+check '(def {n} 0)
+       (print (transduce (comp (mapping (\ {x} {do (def {n} (+ n 1)) x})) (taking 3)) conj {} (range 1000)) n)' \
+  "{0 1 2} 3 "
+
+check '(transduce 1 + 0 {1})' \
+  "Error: Incorrect type for argument #1 passed to 'transduce'. Got Long, expected Transducer."
+check '(mapping 1)' \
+  "Error: Incorrect type for argument #1 passed to 'mapping'. Got Long, expected Function."
+check '(comp)' \
+  "Error: Invalid number of arguments passed to 'comp'. Got 0, expected at least 1."
+
+if [ $failed -eq 0 ]; then echo "transducers: ok"; fi
+exit $failed
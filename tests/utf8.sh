@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Checks that strings are indexed, sliced and measured by character rather
+# than by byte, and that char literals hold a whole UTF-8 character, also far
+# into a long string.
+#
+# Usage: tests/utf8.sh [path/to/lispy]
+
+lispy=${1:-./lispy}
+failed=0
+
+check() {
+  source=$1
+  expected=$2
+  actual=$(printf '%s' "$source" | "$lispy" - 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL: lispy reading $source"
+    echo "  expected: $expected"
+    echo "  actual:   $actual"
+    failed=1
+  fi
+}
+
+check '(print (head "héllo") (tail "héllo") (take 2 "héllo") (drop 3 "héllo") (len "héllo") (nth "héllo" 1))' \
+  "\"h\" \"éllo\" \"hé\" \"lo\" 5 'é' "
+check "(print 'é' '日' '😀' (len \"\") (len \"😀x\") (nth \"a😀b\" 1) (nth \"a😀b\" 2))" \
+  "'é' '日' '😀' 0 2 '😀' 'b' "
+check '(print (take 3 "añ") (drop 5 "añ") (join "ab" "çd") (join "日" "" "本"))' \
+  "\"añ\" \"\" \"abçd\" \"日本\" "
+check "(print (== 'é' (nth \"é\" 0)) (== (tail \"xé\") \"é\") (contains? \"añb\" 'ñ') (contains? \"añb\" 'n'))" \
+  "true true true false "
+
+# Two thousand characters of two and three bytes each, and one more
+long=$(awk 'BEGIN { for (i = 0; i < 1000; i++) printf "é日" }')
+check "(def {s} \"${long}a\")
+       (print (len s) (nth s 1998) (nth s 1999) (nth s 2000) (drop 1998 s) (len (tail s)) (nth (tail s) 0))" \
+  "2001 'é' '日' 'a' \"é日a\" 2000 '日' "
+
+check '(nth "añ" 2)' "Error: Index 2 passed to 'nth' is out of range."
+check '(tail "")' "Error: Empty string passed to 'tail' as argument #1."
+check "(join \"a\" 'ñ')" \
+  "Error: Incorrect type for argument #2 passed to 'join'. Got Character, expected String."
+
+if [ $failed -eq 0 ]; then echo "utf8: ok"; fi
+exit $failed